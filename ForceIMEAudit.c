@@ -0,0 +1,149 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMEAudit
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// This is an LD_AUDIT companion for ForceIMESupport.so.
+//
+// UnityPlayer.so grabs its X11 symbols via dlsym(), which skips right past anything in LD_PRELOAD.
+// The old fix was to hex edit "dlsym" into "Dlsym" in UnityPlayer.so, and redo that after every Unity update.
+//
+// Instead, this hooks into the dynamic linker itself:
+//
+// - la_objopen() watches for ForceIMESupport.so getting loaded, and asks for symbol binding callbacks on everything.
+//   (We don't need la_objsearch() - the shim still gets loaded through LD_PRELOAD, so we just wait for it to show up.)
+//
+// - la_symbind64() gets called once per binding - including the ones made through dlsym().
+//   If the symbol is one that ForceIMESupport.so hooks, we hand back its version instead.
+//   This happens when the symbol gets bound, not when it gets called, so there's no trampoline in the way afterwards.
+//   (We deliberately don't provide la_pltenter()/la_pltexit(), as those WOULD put a trampoline in the way.)
+//
+// Usage:
+//   LD_AUDIT=./ForceIMEAudit.so LD_PRELOAD=./ForceIMESupport.so ./your_program
+//
+// ForceIMESupport.so still needs to be preloaded. This just makes sure nobody gets around it.
+//
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <link.h>
+
+#define SHIM_NAME "ForceIMESupport.so"
+
+//
+// Auditors live in their own linker namespace, so we can't just link against the shim.
+// We remember its link_map when it gets opened, and look up forceime_hook_for() from it the first time we need it.
+//
+static struct link_map *shim_map = NULL;
+static uintptr_t *shim_cookie = NULL;
+static void *(*shim_hook_for)(const char *symbol) = NULL;
+
+//
+// Until the linker has finished relocating everything, the shim isn't safe to call into.
+// Bindings made before then still get the shim through LD_PRELOAD in the usual way.
+//
+static int shim_ready = 0;
+
+//
+// Calling dlsym() on a handle from the other namespace blows up in our face, so we do the lookup ourselves.
+// This walks the shim's DT_GNU_HASH table, which every toolchain from this century emits.
+//
+static uint32_t _gnu_hash(const char *name) {
+  uint32_t h = 5381;
+  for (; *name != '\0'; name++) {
+    h = (h << 5) + h + (unsigned char)*name;
+  }
+  return h;
+}
+
+static void *_shim_lookup(const char *name) {
+  const ElfW(Sym) *symtab = NULL;
+  const char *strtab = NULL;
+  const uint32_t *gnu_hash = NULL;
+  for (const ElfW(Dyn) *d = shim_map->l_ld; d->d_tag != DT_NULL; d++) {
+    // glibc normally relocates these in place, but not always. An unrelocated one is smaller than the load address.
+    uintptr_t p = d->d_un.d_ptr;
+    if (p < shim_map->l_addr) { p += shim_map->l_addr; }
+    if (d->d_tag == DT_SYMTAB) { symtab = (const ElfW(Sym) *)p; }
+    if (d->d_tag == DT_STRTAB) { strtab = (const char *)p; }
+    if (d->d_tag == DT_GNU_HASH) { gnu_hash = (const uint32_t *)p; }
+  }
+  if (symtab == NULL || strtab == NULL || gnu_hash == NULL) { return NULL; }
+
+  uint32_t nbuckets = gnu_hash[0];
+  uint32_t symoffset = gnu_hash[1];
+  uint32_t bloom_size = gnu_hash[2];
+  const ElfW(Addr) *bloom = (const ElfW(Addr) *)&gnu_hash[4];
+  const uint32_t *buckets = (const uint32_t *)&bloom[bloom_size];
+  const uint32_t *chain = &buckets[nbuckets];
+
+  uint32_t h = _gnu_hash(name);
+  for (uint32_t i = buckets[h % nbuckets]; i >= symoffset && i != 0; i++) {
+    uint32_t h2 = chain[i - symoffset];
+    if ((h | 1) == (h2 | 1) && !strcmp(name, &strtab[symtab[i].st_name]) && symtab[i].st_shndx != SHN_UNDEF) {
+      return (void *)(shim_map->l_addr + symtab[i].st_value);
+    }
+    if ((h2 & 1) != 0) { break; } // End of chain
+  }
+  return NULL;
+}
+
+unsigned int la_version(unsigned int version) {
+  // We only use the basic parts of the interface, which every version has.
+  (void)version;
+  return LAV_CURRENT;
+}
+
+unsigned int la_objopen(struct link_map *map, Lmid_t lmid, uintptr_t *cookie) {
+  if (lmid == LM_ID_BASE && shim_map == NULL && map->l_name != NULL) {
+    const char *base = strrchr(map->l_name, '/');
+    base = (base != NULL ? base + 1 : map->l_name);
+    if (!strcmp(base, SHIM_NAME)) {
+      shim_map = map;
+      shim_cookie = cookie;
+    }
+  }
+
+  // We need to see both sides of every binding.
+  return LA_FLG_BINDTO | LA_FLG_BINDFROM;
+}
+
+void la_preinit(uintptr_t *cookie) {
+  (void)cookie;
+  shim_ready = 1;
+}
+
+uintptr_t la_symbind64(Elf64_Sym *sym, unsigned int ndx, uintptr_t *refcook, uintptr_t *defcook, unsigned int *flags, const char *symname) {
+  (void)ndx;
+  (void)flags;
+
+  // No shim? Nothing to do.
+  if (shim_map == NULL || !shim_ready) { return sym->st_value; }
+
+  // Anything that already binds to the shim is fine.
+  // Anything the shim binds is the shim looking for the real function, so leave those alone too!
+  if (defcook == shim_cookie || refcook == shim_cookie) { return sym->st_value; }
+
+  // Only bother with X11 functions. Everything else gets bound normally without looking at the shim at all.
+  if (symname[0] != 'X') { return sym->st_value; }
+
+  if (shim_hook_for == NULL) {
+    shim_hook_for = _shim_lookup("forceime_hook_for");
+    if (shim_hook_for == NULL) {
+      fprintf(stderr, "ForceIMEAudit: " SHIM_NAME " has no forceime_hook_for()! Not redirecting anything.\n");
+      shim_map = NULL;
+      return sym->st_value;
+    }
+  }
+
+  void *hooked = shim_hook_for(symname);
+  if (hooked != NULL) {
+    return (uintptr_t)hooked;
+  }
+
+  return sym->st_value;
+}
@@ -0,0 +1,324 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMEBench
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// This measures what ForceIMESupport.so adds to each Xlib call it hooks, on top of ForceIMEStubXlib.so (see ForceIMEStubXlib.h),
+// and how fast it can hand out a queued commit.
+//
+// Usage:
+//   ./ForceIMEBench [-n calls] [path/to/ForceIMESupport.so]
+//
+// For each hook, we call the stub's function directly, then the same thing through the shim, -n times each (default: 1000000).
+// The best of a few runs goes in the table, as nanoseconds per call and, on x86, TSC cycles per call. "extra" is the difference.
+// The stub doesn't have anything queued, so this is the cost when the shim has nothing to do - which is nearly all the time.
+//
+// Then we commit some text and drain it through the shim, the way a program does: XPending(), XNextEvent(), XFilterEvent(),
+// Xutf8LookupString(), once per character. That's the cost per character handed out, start to finish.
+// We do that with a short phrase, and with 4 KB commits of ASCII and of CJK. If handing out a character ever stops being O(1),
+// the 4 KB ones will show it.
+//
+// The shim's settings come from the environment as usual, so e.g. FORCEIME_DELIVERY=burst ./ForceIMEBench measures that.
+// XInitThreads() isn't in the table. It only gets called once, and it'd leave the shim in threaded mode for everything after it.
+//
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include <dlfcn.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "ForceIMEStubXlib.h"
+
+//
+// Everything we call, either straight into the stub or through the shim.
+//
+#define FORCEIME_BENCH_FUNCTIONS(X) \
+  X(XCheckIfEvent) \
+  X(XCheckMaskEvent) \
+  X(XCheckTypedEvent) \
+  X(XCheckTypedWindowEvent) \
+  X(XCheckWindowEvent) \
+  X(XCloseDisplay) \
+  X(XCloseIM) \
+  X(XCreateIC) \
+  X(XDestroyIC) \
+  X(XEventsQueued) \
+  X(XFilterEvent) \
+  X(XIfEvent) \
+  X(XMaskEvent) \
+  X(XNextEvent) \
+  X(XOpenIM) \
+  X(XPeekEvent) \
+  X(XPeekIfEvent) \
+  X(XPending) \
+  X(XSetICFocus) \
+  X(XUnsetICFocus) \
+  X(XWindowEvent) \
+  X(XmbLookupString) \
+  X(Xutf8LookupString) \
+  X(XwcLookupString)
+
+struct xlib_calls {
+#define X(name) __typeof__(&name) name;
+  FORCEIME_BENCH_FUNCTIONS(X)
+#undef X
+};
+
+static struct xlib_calls stub = {
+#define X(name) .name = name,
+  FORCEIME_BENCH_FUNCTIONS(X)
+#undef X
+};
+static struct xlib_calls shim;
+
+static uint64_t _now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t _ticks(void) {
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static Bool _any_event(Display *display, XEvent *event, XPointer arg) {
+  (void)display;
+  (void)event;
+  (void)arg;
+  return True;
+}
+
+//
+// What the calls work on. The IC and IM come from the shim, so they're good for both (the stub doesn't care whose they are).
+//
+static Display *display = NULL;
+static XIM im = NULL;
+static XIC ic = NULL;
+static XEvent key;
+
+//
+// One loop per hook. The stub has nothing queued, so anything that would wait gets the idle event (MotionNotify on window 0).
+//
+#define FORCEIME_BENCH_CASES(X) \
+  X(XPending, "XPending", (void)x->XPending(display)) \
+  X(XEventsQueued, "XEventsQueued", (void)x->XEventsQueued(display, QueuedAfterReading)) \
+  X(XNextEvent, "XNextEvent", (void)x->XNextEvent(display, &event)) \
+  X(XPeekEvent, "XPeekEvent", (void)x->XPeekEvent(display, &event)) \
+  X(XIfEvent, "XIfEvent", (void)x->XIfEvent(display, &event, _any_event, NULL)) \
+  X(XPeekIfEvent, "XPeekIfEvent", (void)x->XPeekIfEvent(display, &event, _any_event, NULL)) \
+  X(XMaskEvent, "XMaskEvent", (void)x->XMaskEvent(display, PointerMotionMask, &event)) \
+  X(XWindowEvent, "XWindowEvent", (void)x->XWindowEvent(display, 0, PointerMotionMask, &event)) \
+  X(XCheckIfEvent, "XCheckIfEvent", (void)x->XCheckIfEvent(display, &event, _any_event, NULL)) \
+  X(XCheckMaskEvent, "XCheckMaskEvent", (void)x->XCheckMaskEvent(display, KeyPressMask, &event)) \
+  X(XCheckTypedEvent, "XCheckTypedEvent", (void)x->XCheckTypedEvent(display, KeyPress, &event)) \
+  X(XCheckTypedWindowEvent, "XCheckTypedWindowEvent", (void)x->XCheckTypedWindowEvent(display, 1, KeyPress, &event)) \
+  X(XCheckWindowEvent, "XCheckWindowEvent", (void)x->XCheckWindowEvent(display, 1, KeyPressMask, &event)) \
+  X(XFilterEvent, "XFilterEvent", (void)x->XFilterEvent(&key, 0)) \
+  X(Xutf8LookupString, "Xutf8LookupString", (void)x->Xutf8LookupString(ic, &key.xkey, buf, sizeof(buf), &keysym, &status)) \
+  X(XmbLookupString, "XmbLookupString", (void)x->XmbLookupString(ic, &key.xkey, buf, sizeof(buf), &keysym, &status)) \
+  X(XwcLookupString, "XwcLookupString", (void)x->XwcLookupString(ic, &key.xkey, wbuf, 16, &keysym, &status)) \
+  X(XSetICFocus, "XSetICFocus", x->XSetICFocus(ic)) \
+  X(XUnsetICFocus, "XUnsetICFocus", x->XUnsetICFocus(ic)) \
+  X(XCreateIC, "XCreateIC + XDestroyIC", \
+    x->XDestroyIC(x->XCreateIC(im, XNInputStyle, XIMPreeditNothing | XIMStatusNothing, XNClientWindow, (Window)2, XNFocusWindow, (Window)2, NULL))) \
+  X(XOpenIM, "XOpenIM + XCloseIM", (void)x->XCloseIM(x->XOpenIM(display, NULL, NULL, NULL))) \
+  X(XCloseDisplay, "XCloseDisplay", (void)x->XCloseDisplay(display))
+
+#define X(id, label, call) \
+  static void _loop_##id(const struct xlib_calls *x, long calls) { \
+    XEvent event; \
+    char buf[64]; \
+    wchar_t wbuf[16]; \
+    KeySym keysym; \
+    Status status; \
+    (void)event; (void)buf; (void)wbuf; (void)keysym; (void)status; \
+    for (long i = 0; i < calls; i++) { call; } \
+  }
+FORCEIME_BENCH_CASES(X)
+#undef X
+
+static const struct {
+  const char *label;
+  void (*loop)(const struct xlib_calls *x, long calls);
+} bench_cases[] = {
+#define X(id, label, call) { label, _loop_##id },
+  FORCEIME_BENCH_CASES(X)
+#undef X
+};
+
+struct timing {
+  double ns;
+  double ticks;
+};
+
+// The best of a few runs, per call. Anything slower than that was something else getting in the way.
+#define RUNS 5
+static struct timing _time_loop(void (*loop)(const struct xlib_calls *x, long calls), const struct xlib_calls *x, long calls) {
+  loop(x, calls / 10 + 1); // Warm up
+  struct timing best = { 1e30, 1e30 };
+  for (int run = 0; run < RUNS; run++) {
+    uint64_t t0 = _now_ns();
+    uint64_t c0 = _ticks();
+    loop(x, calls);
+    uint64_t c1 = _ticks();
+    uint64_t t1 = _now_ns();
+    if ((double)(t1 - t0) / calls < best.ns) {
+      best.ns = (double)(t1 - t0) / calls;
+      best.ticks = (double)(c1 - c0) / calls;
+    }
+  }
+  return best;
+}
+
+//
+// Drains one commit through the shim, like a program would. Returns how many characters came out.
+//
+static long _drain_commit(const char *text) {
+  forceime_stub_commit(1, 38, text);
+  long chars = 0;
+  while (shim.XPending(display) > 0) {
+    XEvent event;
+    shim.XNextEvent(display, &event);
+    if (shim.XFilterEvent(&event, 0) || event.type != KeyPress) { continue; }
+    char buf[64];
+    KeySym keysym;
+    Status status;
+    int len = shim.Xutf8LookupString(ic, &event.xkey, buf, sizeof(buf), &keysym, &status);
+    if (status == XLookupChars || status == XLookupBoth) {
+      for (int i = 0; i < len; i++) {
+        if (((unsigned char)buf[i] & 0xC0) != 0x80) { chars++; }
+      }
+    }
+  }
+  return chars;
+}
+
+static long _utf8_chars(const char *text) {
+  long chars = 0;
+  for (; *text != '\0'; text++) {
+    if (((unsigned char)*text & 0xC0) != 0x80) { chars++; }
+  }
+  return chars;
+}
+
+// Returns False if the shim lost or made up characters.
+static Bool _bench_drain(const char *label, const char *text, long commits) {
+  long expected = _utf8_chars(text);
+  if (_drain_commit(text) != expected) {
+    printf("%-28s lost characters: expected %ld\n", label, expected);
+    return False;
+  }
+  double best = 1e30;
+  for (int run = 0; run < RUNS; run++) {
+    uint64_t t0 = _now_ns();
+    for (long i = 0; i < commits; i++) {
+      if (_drain_commit(text) != expected) {
+        printf("%-28s lost characters: expected %ld\n", label, expected);
+        return False;
+      }
+    }
+    double ns = (double)(_now_ns() - t0) / (commits * expected);
+    if (ns < best) { best = ns; }
+  }
+  printf("%-28s %5ld chars %9.1f ns/char %12.0f chars/s\n", label, expected, best, 1e9 / best);
+  return True;
+}
+
+int main(int argc, char *argv[]) {
+  long calls = 1000000;
+  int argi = 1;
+  if (argi + 1 < argc && !strcmp(argv[argi], "-n")) {
+    calls = atol(argv[argi + 1]);
+    argi += 2;
+  }
+  if (argc > argi + 1 || calls <= 0) {
+    fprintf(stderr, "usage: %s [-n calls] [path/to/ForceIMESupport.so]\n", argv[0]);
+    return 2;
+  }
+  const char *shim_path = (argi < argc ? argv[argi] : "./ForceIMESupport.so");
+
+  // The shim has to take its real functions from the very same stub we're linked against.
+  Dl_info stub_info;
+  if (!dladdr((void *)forceime_stub_display, &stub_info) || stub_info.dli_fname == NULL) {
+    fprintf(stderr, "%s: could not find ForceIMEStubXlib.so\n", argv[0]);
+    return 2;
+  }
+  setenv("FORCEIME_XLIB", stub_info.dli_fname, 1);
+  setenv("FORCEIME_RECORD", "", 1);
+  setenv("FORCEIME_LOG", "warn", 0); // The shim says hello on every XCreateIC(), which we do a lot of
+  void *lib = dlopen(shim_path, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL) {
+    fprintf(stderr, "%s: could not load shim: %s\n", argv[0], dlerror());
+    return 2;
+  }
+#define X(name) \
+  shim.name = dlsym(lib, #name); \
+  if (shim.name == NULL) { \
+    fprintf(stderr, "%s: shim has no %s()\n", argv[0], #name); \
+    return 2; \
+  }
+  FORCEIME_BENCH_FUNCTIONS(X)
+#undef X
+
+  display = forceime_stub_display();
+  im = shim.XOpenIM(display, NULL, NULL, NULL);
+  ic = shim.XCreateIC(im, XNInputStyle, XIMPreeditNothing | XIMStatusNothing, XNClientWindow, (Window)1, XNFocusWindow, (Window)1, NULL);
+  if (im == NULL || ic == NULL) {
+    fprintf(stderr, "%s: could not set up an IC\n", argv[0]);
+    return 2;
+  }
+  memset(&key, 0, sizeof(key));
+  key.xkey.type = KeyPress;
+  key.xkey.display = display;
+  key.xkey.window = 1;
+  key.xkey.keycode = 38;
+
+  printf("%-28s %10s %10s %10s %12s\n", "hook", "stub ns", "shim ns", "extra ns", "extra cycles");
+  for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+    struct timing direct = _time_loop(bench_cases[i].loop, &stub, calls);
+    struct timing hooked = _time_loop(bench_cases[i].loop, &shim, calls);
+    printf("%-28s %10.1f %10.1f %10.1f", bench_cases[i].label, direct.ns, hooked.ns, hooked.ns - direct.ns);
+#ifdef HAVE_TSC
+    printf(" %12.0f\n", hooked.ticks - direct.ticks);
+#else
+    printf(" %12s\n", "-");
+#endif
+  }
+
+  printf("\n");
+  Bool ok = True;
+  long commits = calls / 1000 + 1;
+  ok &= _bench_drain("drain: phrase", "日本語を入力しています。Mixed ASCII too.", commits);
+
+  // A 4 KB commit - a long paste, say. Each character should cost the same as in a short one.
+  static char ascii_4k[4097];
+  for (int i = 0; i < 4096; i++) {
+    ascii_4k[i] = 'a' + i % 26;
+  }
+  static char cjk_4k[4097];
+  for (int i = 0; i + 3 <= 4096; i += 3) {
+    memcpy(&cjk_4k[i], "漢", 3);
+  }
+  cjk_4k[4095] = '.';
+  ok &= _bench_drain("drain: 4 KB ASCII", ascii_4k, commits / 100 + 1);
+  ok &= _bench_drain("drain: 4 KB CJK", cjk_4k, commits / 100 + 1);
+  return (ok ? 0 : 1);
+}
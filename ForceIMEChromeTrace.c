@@ -0,0 +1,346 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMEChromeTrace
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// This turns a trace recorded with FORCEIME_RECORD into Chrome's trace event JSON,
+// which you can open in https://ui.perfetto.dev or chrome://tracing.
+//
+// Usage:
+//   ./ForceIMEChromeTrace trace.bin [out.json]
+//
+// Without out.json, it goes to stdout.
+//
+// What you get:
+// - A "program" track, with every hook the program called. Synthetic KeyPress events from XNextEvent() are marked as such.
+// - An "Xlib" track, with every real function the shim called. A real *LookupString() that returned text is an IME commit.
+// - A flow arrow for each character, from the commit it came in with to the *LookupString() call that handed it over.
+//   Characters come out of each window's queue in the order they went in, so that's how we pair them up.
+//   A long arrow is a character that sat in the queue for a long time.
+// - A "queued chars" counter, going up at each commit and down as characters get handed over.
+//
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+
+#include "ForceIMETrace.h"
+
+static const char *records_end = NULL;
+
+static const char *func_names[] = {
+  [FORCEIME_TRACE_XNextEvent] = "XNextEvent",
+  [FORCEIME_TRACE_XPending] = "XPending",
+  [FORCEIME_TRACE_XEventsQueued] = "XEventsQueued",
+  [FORCEIME_TRACE_Xutf8LookupString] = "Xutf8LookupString",
+  [FORCEIME_TRACE_XmbLookupString] = "XmbLookupString",
+  [FORCEIME_TRACE_XwcLookupString] = "XwcLookupString",
+  [FORCEIME_TRACE_XFilterEvent] = "XFilterEvent",
+  [FORCEIME_TRACE_XCheckTypedEvent] = "XCheckTypedEvent",
+  [FORCEIME_TRACE_XOpenIM] = "XOpenIM",
+  [FORCEIME_TRACE_XCreateIC] = "XCreateIC",
+  [FORCEIME_TRACE_XPeekEvent] = "XPeekEvent",
+  [FORCEIME_TRACE_XIfEvent] = "XIfEvent",
+  [FORCEIME_TRACE_XCheckIfEvent] = "XCheckIfEvent",
+  [FORCEIME_TRACE_XPeekIfEvent] = "XPeekIfEvent",
+  [FORCEIME_TRACE_XMaskEvent] = "XMaskEvent",
+  [FORCEIME_TRACE_XCheckMaskEvent] = "XCheckMaskEvent",
+  [FORCEIME_TRACE_XWindowEvent] = "XWindowEvent",
+  [FORCEIME_TRACE_XCheckWindowEvent] = "XCheckWindowEvent",
+  [FORCEIME_TRACE_XCheckTypedWindowEvent] = "XCheckTypedWindowEvent",
+  [FORCEIME_TRACE_XDestroyIC] = "XDestroyIC",
+  [FORCEIME_TRACE_XSetICFocus] = "XSetICFocus",
+  [FORCEIME_TRACE_XUnsetICFocus] = "XUnsetICFocus",
+  [FORCEIME_TRACE_XCloseDisplay] = "XCloseDisplay",
+};
+#define FUNC_COUNT ((int)(sizeof(func_names) / sizeof(func_names[0])))
+
+#define TID_PROGRAM 1
+#define TID_XLIB 2
+
+static const struct forceime_trace_record *_next_record(const char *p) {
+  const struct forceime_trace_record *r = (const struct forceime_trace_record *)p;
+  if (p + sizeof(*r) > records_end || r->record_size < sizeof(*r) || p + r->record_size > records_end) { return NULL; }
+  return r;
+}
+
+static Bool _is_lookup(int func) {
+  return (func == FORCEIME_TRACE_Xutf8LookupString || func == FORCEIME_TRACE_XmbLookupString || func == FORCEIME_TRACE_XwcLookupString);
+}
+
+//
+// Each window's characters that have been committed but not handed over yet, as flow IDs.
+// Nothing in here gets big - a window's queue only fills back up once it's empty.
+//
+#define MAX_WINDOWS 16
+struct pending_chars {
+  uint64_t window;
+  uint64_t *ids;
+  int head;
+  int tail;
+  int size;
+};
+static struct pending_chars pending[MAX_WINDOWS];
+static uint64_t next_flow_id = 1;
+static long long queued_chars = 0;
+
+static struct pending_chars *_pending_for(uint64_t window) {
+  struct pending_chars *free_slot = NULL;
+  for (int i = 0; i < MAX_WINDOWS; i++) {
+    if (pending[i].ids != NULL && pending[i].window == window) { return &pending[i]; }
+    if (pending[i].ids == NULL && free_slot == NULL) { free_slot = &pending[i]; }
+  }
+  if (free_slot == NULL) { return NULL; }
+  free_slot->window = window;
+  free_slot->size = 64;
+  free_slot->ids = malloc(free_slot->size * sizeof(uint64_t));
+  free_slot->head = free_slot->tail = 0;
+  return (free_slot->ids != NULL ? free_slot : NULL);
+}
+
+static void _pending_push(struct pending_chars *p, uint64_t id) {
+  if (p->tail == p->size) {
+    // Slide what's left down to the start, and grow if that doesn't make room.
+    memmove(p->ids, p->ids + p->head, (p->tail - p->head) * sizeof(uint64_t));
+    p->tail -= p->head;
+    p->head = 0;
+    if (p->tail == p->size) {
+      uint64_t *bigger = realloc(p->ids, p->size * 2 * sizeof(uint64_t));
+      if (bigger == NULL) { return; }
+      p->ids = bigger;
+      p->size *= 2;
+    }
+  }
+  p->ids[p->tail++] = id;
+}
+
+//
+// JSON output.
+//
+static FILE *out = NULL;
+static Bool first_event = True;
+
+static void _begin_event(void) {
+  fputs(first_event ? "\n  " : ",\n  ", out);
+  first_event = False;
+}
+
+static void _json_string(const unsigned char *s, int len) {
+  fputc('"', out);
+  for (int i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20 || c == 0x7F) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      // The shim only ever queues valid UTF-8, but a real *LookupString() can hand over anything.
+      // JSON has to be UTF-8, so anything that isn't gets a '?'.
+      int n = (c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 0);
+      Bool ok = (n > 0 && i + n <= len);
+      uint32_t cp = (n == 1 ? c : n == 2 ? (c & 0x1F) : n == 3 ? (c & 0x0F) : (c & 0x07));
+      for (int k = 1; ok && k < n; k++) {
+        ok = ((s[i + k] & 0xC0) == 0x80);
+        cp = (cp << 6) | (s[i + k] & 0x3F);
+      }
+      // No overlong forms, surrogates, or anything past U+10FFFF.
+      static const uint32_t min_cp[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+      ok = ok && cp >= min_cp[n] && (cp < 0xD800 || cp > 0xDFFF) && cp <= 0x10FFFF;
+      if (ok) {
+        fwrite(&s[i], 1, n, out);
+        i += n - 1;
+      } else {
+        fputc('?', out);
+      }
+    }
+  }
+  fputc('"', out);
+}
+
+// Turns one wchar_t into UTF-8. Returns how many bytes that took.
+static int _wchar_utf8(wchar_t wc, unsigned char *buf) {
+  uint32_t c = (uint32_t)wc;
+  if (c < 0x80) { buf[0] = c; return 1; }
+  if (c < 0x800) { buf[0] = 0xC0 | (c >> 6); buf[1] = 0x80 | (c & 0x3F); return 2; }
+  if (c >= 0xD800 && c <= 0xDFFF) { buf[0] = '?'; return 1; }
+  if (c < 0x10000) { buf[0] = 0xE0 | (c >> 12); buf[1] = 0x80 | ((c >> 6) & 0x3F); buf[2] = 0x80 | (c & 0x3F); return 3; }
+  if (c < 0x110000) {
+    buf[0] = 0xF0 | (c >> 18); buf[1] = 0x80 | ((c >> 12) & 0x3F); buf[2] = 0x80 | ((c >> 6) & 0x3F); buf[3] = 0x80 | (c & 0x3F);
+    return 4;
+  }
+  buf[0] = '?';
+  return 1;
+}
+
+// Writes a *LookupString()'s text out as a JSON string.
+static void _json_text(const struct forceime_trace_record *r) {
+  if (r->func != FORCEIME_TRACE_XwcLookupString) {
+    _json_string((const unsigned char *)(r + 1), r->payload_len);
+    return;
+  }
+  unsigned char utf8[4 * 64];
+  int used = 0;
+  const wchar_t *wcs = (const wchar_t *)(r + 1);
+  int count = r->payload_len / sizeof(wchar_t);
+  for (int i = 0; i < count && used + 4 <= (int)sizeof(utf8); i++) {
+    used += _wchar_utf8(wcs[i], &utf8[used]);
+  }
+  _json_string(utf8, used);
+}
+
+//
+// How many characters a *LookupString() handed over.
+// XmbLookupString() gives the locale's encoding, which we don't know here. Most likely it's UTF-8, so we count it that way.
+//
+static int _char_count(const struct forceime_trace_record *r) {
+  if (r->func == FORCEIME_TRACE_XwcLookupString) { return r->payload_len / sizeof(wchar_t); }
+  const unsigned char *s = (const unsigned char *)(r + 1);
+  int chars = 0;
+  for (uint32_t i = 0; i < r->payload_len; i++) {
+    if ((s[i] & 0xC0) != 0x80) { chars++; }
+  }
+  return chars;
+}
+
+static void _write_slice(const struct forceime_trace_record *r) {
+  int tid = (r->kind == FORCEIME_TRACE_CALL ? TID_PROGRAM : TID_XLIB);
+  const char *name = (r->func < FUNC_COUNT && func_names[r->func] != NULL ? func_names[r->func] : "unknown");
+  Bool synthetic = (r->func == FORCEIME_TRACE_XNextEvent && r->event.type == KeyPress && r->event.keycode == 0);
+  _begin_event();
+  fprintf(out, "{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"cat\":\"%s\",\"name\":\"%s%s\",\"args\":{\"result\":%d",
+    tid, r->ns / 1e3, r->dur_ns / 1e3, (synthetic ? "synthetic" : r->kind == FORCEIME_TRACE_CALL ? "hook" : "real"),
+    name, (synthetic ? " (synthetic)" : ""), r->result);
+  if (r->func == FORCEIME_TRACE_XEventsQueued) { fprintf(out, ",\"mode\":%d", r->arg); }
+  if (r->func == FORCEIME_TRACE_XCheckTypedEvent || r->func == FORCEIME_TRACE_XCheckTypedWindowEvent) { fprintf(out, ",\"event_type\":%d", r->arg); }
+  if (r->func == FORCEIME_TRACE_XMaskEvent || r->func == FORCEIME_TRACE_XCheckMaskEvent
+    || r->func == FORCEIME_TRACE_XWindowEvent || r->func == FORCEIME_TRACE_XCheckWindowEvent) {
+    fprintf(out, ",\"event_mask\":\"0x%x\"", (unsigned)r->arg);
+  }
+  if (r->ic != 0) { fprintf(out, ",\"ic\":\"0x%llx\"", (unsigned long long)r->ic); }
+  if (r->func == FORCEIME_TRACE_XCreateIC) { fprintf(out, ",\"input_style\":\"0x%x\",\"client_window\":\"0x%llx\"", r->arg, (unsigned long long)r->event.window); }
+  if (_is_lookup(r->func)) { fprintf(out, ",\"status\":%d", r->arg); }
+  if (r->event.type != 0) {
+    fprintf(out, ",\"event\":{\"type\":%d,\"window\":\"0x%llx\"", r->event.type, (unsigned long long)r->event.window);
+    if (r->event.type == KeyPress || r->event.type == KeyRelease) {
+      fprintf(out, ",\"keycode\":%u,\"state\":%u,\"time\":%u", r->event.keycode, r->event.state, r->event.time);
+    }
+    fputc('}', out);
+  }
+  if (_is_lookup(r->func) && r->payload_len > 0) {
+    fputs(",\"text\":", out);
+    _json_text(r);
+  }
+  fputs("}}", out);
+}
+
+static void _write_flow(const char *phase, uint64_t id, int tid, uint64_t ns) {
+  _begin_event();
+  fprintf(out, "{\"ph\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"cat\":\"char\",\"name\":\"char\",\"id\":%llu%s}",
+    phase, tid, ns / 1e3, (unsigned long long)id, (phase[0] == 'f' ? ",\"bp\":\"e\"" : ""));
+}
+
+static void _write_queued(uint64_t ns) {
+  _begin_event();
+  fprintf(out, "{\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"name\":\"queued chars\",\"args\":{\"chars\":%lld}}", ns / 1e3, queued_chars);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s trace.bin [out.json]\n", argv[0]);
+    return 2;
+  }
+  const char *trace_path = argv[1];
+
+  int fd = open(trace_path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct forceime_trace_header)) {
+    fprintf(stderr, "%s: could not read trace \"%s\"\n", argv[0], trace_path);
+    return 2;
+  }
+  const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "%s: could not map trace \"%s\"\n", argv[0], trace_path);
+    return 2;
+  }
+  const struct forceime_trace_header *header = (const struct forceime_trace_header *)map;
+  if (memcmp(header->magic, FORCEIME_TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != FORCEIME_TRACE_VERSION) {
+    fprintf(stderr, "%s: \"%s\" isn't a version %d trace\n", argv[0], trace_path, FORCEIME_TRACE_VERSION);
+    return 2;
+  }
+  const char *records_start = map + header->header_size;
+  records_end = records_start + header->used;
+  if (records_end > map + st.st_size) { records_end = map + st.st_size; }
+
+  out = stdout;
+  if (argc == 3) {
+    out = fopen(argv[2], "w");
+    if (out == NULL) {
+      fprintf(stderr, "%s: could not write \"%s\"\n", argv[0], argv[2]);
+      return 2;
+    }
+  }
+
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+  _begin_event();
+  fprintf(out, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"ForceIMESupport\"}}");
+  _begin_event();
+  fprintf(out, "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"program\"}}", TID_PROGRAM);
+  _begin_event();
+  fprintf(out, "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"Xlib\"}}", TID_XLIB);
+
+  int records = 0;
+  int unmatched = 0;
+  for (const char *p = records_start; ; ) {
+    const struct forceime_trace_record *r = _next_record(p);
+    if (r == NULL) { break; }
+    p += r->record_size;
+    records++;
+    _write_slice(r);
+
+    if (!_is_lookup(r->func) || r->payload_len == 0) { continue; }
+    struct pending_chars *q = _pending_for(r->event.window);
+    int chars = _char_count(r);
+    if (r->kind == FORCEIME_TRACE_REAL) {
+      // A commit. Each character starts a flow here.
+      for (int i = 0; i < chars; i++) {
+        uint64_t id = next_flow_id++;
+        _write_flow("s", id, TID_XLIB, r->ns);
+        if (q != NULL) { _pending_push(q, id); }
+      }
+      queued_chars += chars;
+      _write_queued(r->ns);
+    } else {
+      // The program getting characters. Each one finishes the oldest flow for its window.
+      for (int i = 0; i < chars; i++) {
+        if (q != NULL && q->head < q->tail) {
+          _write_flow("f", q->ids[q->head++], TID_PROGRAM, r->ns);
+        } else {
+          unmatched++;
+        }
+      }
+      queued_chars -= chars;
+      _write_queued(r->ns + r->dur_ns);
+    }
+  }
+  fputs("\n]}\n", out);
+  if (out != stdout) { fclose(out); }
+
+  fprintf(stderr, "%d records, %llu characters committed", records, (unsigned long long)(next_flow_id - 1));
+  if (unmatched > 0) { fprintf(stderr, ", %d handed over that we didn't see get committed", unmatched); }
+  fputc('\n', stderr);
+  if (header->dropped != 0) {
+    fprintf(stderr, "warning: the recording dropped %llu records, so some flows will be missing\n", (unsigned long long)header->dropped);
+  }
+  return 0;
+}
@@ -0,0 +1,589 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMEReplay
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// This plays a trace recorded with FORCEIME_RECORD back through ForceIMESupport.so, without an X server.
+//
+// Usage:
+//   ./ForceIMEReplay [-s speed] trace.bin [path/to/ForceIMESupport.so]
+//
+// -s sets how fast to go. 1 is the original speed (the default), 10 is ten times faster, and 0 is as fast as possible.
+//
+// How it works:
+// - This program provides its own Xlib functions, and tells the shim to use them (FORCEIME_XLIB="", see ForceIMESupport.c).
+//   It gets built with -rdynamic so that the shim can actually see them.
+// - Every hook call the program made (FORCEIME_TRACE_CALL) gets made again, at the same time it originally happened.
+// - Whenever the shim calls a real function, our version answers with the next thing that function returned in the trace
+//   (FORCEIME_TRACE_REAL).
+// - Whatever the shim gives back gets compared with what it gave back at the time. Any differences get printed.
+// - Some things don't make it into the trace, like the program's XIfEvent() predicates. See ForceIMETrace.h for what we do instead.
+//
+// Exits with 0 if everything matched, 1 if something didn't, and 2 if it couldn't replay at all.
+//
+// Set FORCEIME_STATS_FILE as well to get the shim's latency histograms for the replay.
+//
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xresource.h>
+
+#include "ForceIMETrace.h"
+
+static const char *records_start = NULL;
+static const char *records_end = NULL;
+
+//
+// The shim only uses the Display pointer to tell Displays apart, so any unique address will do.
+//
+static char fake_display_storage;
+#define FAKE_DISPLAY ((Display *)&fake_display_storage)
+
+//
+// How far through the trace each real function has got.
+//
+#define MAX_TRACE_FUNC 32
+static const char *real_cursor[MAX_TRACE_FUNC];
+static int real_exhausted = 0;
+
+static const struct forceime_trace_record *_next_record(const char *p) {
+  const struct forceime_trace_record *r = (const struct forceime_trace_record *)p;
+  if (p + sizeof(*r) > records_end || r->record_size < sizeof(*r) || p + r->record_size > records_end) { return NULL; }
+  return r;
+}
+
+static const struct forceime_trace_record *_next_real(int func) {
+  const char *p = real_cursor[func];
+  for (;;) {
+    const struct forceime_trace_record *r = _next_record(p);
+    if (r == NULL) {
+      real_cursor[func] = records_end;
+      real_exhausted++;
+      return NULL;
+    }
+    p += r->record_size;
+    if (r->kind == FORCEIME_TRACE_REAL && r->func == func) {
+      real_cursor[func] = p;
+      return r;
+    }
+  }
+}
+
+static void _untrace_event(XEvent *out, const struct forceime_trace_event *event) {
+  memset(out, 0, sizeof(*out));
+  out->type = event->type;
+  out->xany.display = FAKE_DISPLAY;
+  out->xany.window = event->window;
+  if (event->type == KeyPress || event->type == KeyRelease) {
+    out->xkey.keycode = event->keycode;
+    out->xkey.state = event->state;
+    out->xkey.time = event->time;
+  }
+}
+
+//
+// Our stand-in Xlib.
+// The ones the trace doesn't cover just say something harmless.
+//
+// The ones that look for an event don't need to do any looking: whatever they found is in the trace.
+// So the mask, window and predicate they get given don't matter.
+//
+static int _event_from_trace(int func, XEvent *event_return) {
+  const struct forceime_trace_record *r = _next_real(func);
+  if (r == NULL) {
+    memset(event_return, 0, sizeof(*event_return));
+    return 0;
+  }
+  _untrace_event(event_return, &r->event);
+  return r->result;
+}
+
+static Bool _check_event_from_trace(int func, XEvent *event_return) {
+  const struct forceime_trace_record *r = _next_real(func);
+  if (r == NULL || !r->result) { return False; }
+  _untrace_event(event_return, &r->event);
+  return True;
+}
+
+int XNextEvent(Display *display, XEvent *event_return) {
+  (void)display;
+  return _event_from_trace(FORCEIME_TRACE_XNextEvent, event_return);
+}
+
+int XPending(Display *display) {
+  (void)display;
+  const struct forceime_trace_record *r = _next_real(FORCEIME_TRACE_XPending);
+  return (r != NULL ? r->result : 0);
+}
+
+int XEventsQueued(Display *display, int mode) {
+  (void)display;
+  (void)mode;
+  const struct forceime_trace_record *r = _next_real(FORCEIME_TRACE_XEventsQueued);
+  return (r != NULL ? r->result : 0);
+}
+
+Bool XCheckTypedEvent(Display *display, int event_type, XEvent *event_return) {
+  (void)display;
+  (void)event_type;
+  return _check_event_from_trace(FORCEIME_TRACE_XCheckTypedEvent, event_return);
+}
+
+Bool XCheckTypedWindowEvent(Display *display, Window w, int event_type, XEvent *event_return) {
+  (void)display;
+  (void)w;
+  (void)event_type;
+  return _check_event_from_trace(FORCEIME_TRACE_XCheckTypedWindowEvent, event_return);
+}
+
+int XPeekEvent(Display *display, XEvent *event_return) {
+  (void)display;
+  return _event_from_trace(FORCEIME_TRACE_XPeekEvent, event_return);
+}
+
+int XIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  (void)display;
+  (void)predicate;
+  (void)arg;
+  return _event_from_trace(FORCEIME_TRACE_XIfEvent, event_return);
+}
+
+Bool XCheckIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  (void)display;
+  (void)predicate;
+  (void)arg;
+  return _check_event_from_trace(FORCEIME_TRACE_XCheckIfEvent, event_return);
+}
+
+int XPeekIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  (void)display;
+  (void)predicate;
+  (void)arg;
+  return _event_from_trace(FORCEIME_TRACE_XPeekIfEvent, event_return);
+}
+
+int XMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  (void)display;
+  (void)event_mask;
+  return _event_from_trace(FORCEIME_TRACE_XMaskEvent, event_return);
+}
+
+Bool XCheckMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  (void)display;
+  (void)event_mask;
+  return _check_event_from_trace(FORCEIME_TRACE_XCheckMaskEvent, event_return);
+}
+
+int XWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  (void)display;
+  (void)w;
+  (void)event_mask;
+  return _event_from_trace(FORCEIME_TRACE_XWindowEvent, event_return);
+}
+
+Bool XCheckWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  (void)display;
+  (void)w;
+  (void)event_mask;
+  return _check_event_from_trace(FORCEIME_TRACE_XCheckWindowEvent, event_return);
+}
+
+Bool XFilterEvent(XEvent *event, Window w) {
+  (void)event;
+  (void)w;
+  const struct forceime_trace_record *r = _next_real(FORCEIME_TRACE_XFilterEvent);
+  return (r != NULL ? r->result : False);
+}
+
+static int _lookup_from_trace(int func, void *buffer_return, int buffer_len, int unit_size, KeySym *keysym_return, Status *status_return) {
+  if (keysym_return != NULL) { *keysym_return = NoSymbol; }
+  const struct forceime_trace_record *r = _next_real(func);
+  if (r == NULL) {
+    *status_return = XLookupNone;
+    return 0;
+  }
+  if ((int)r->payload_len > buffer_len * unit_size) {
+    *status_return = XBufferOverflow;
+    return r->payload_len / unit_size;
+  }
+  memcpy(buffer_return, r + 1, r->payload_len);
+  *status_return = r->arg;
+  return r->result;
+}
+
+int Xutf8LookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) {
+  (void)ic;
+  (void)event;
+  return _lookup_from_trace(FORCEIME_TRACE_Xutf8LookupString, buffer_return, bytes_buffer, 1, keysym_return, status_return);
+}
+
+int XmbLookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) {
+  (void)ic;
+  (void)event;
+  return _lookup_from_trace(FORCEIME_TRACE_XmbLookupString, buffer_return, bytes_buffer, 1, keysym_return, status_return);
+}
+
+int XwcLookupString(XIC ic, XKeyPressedEvent *event, wchar_t *buffer_return, int wchars_buffer, KeySym *keysym_return, Status *status_return) {
+  (void)ic;
+  (void)event;
+  return _lookup_from_trace(FORCEIME_TRACE_XwcLookupString, buffer_return, wchars_buffer, sizeof(wchar_t), keysym_return, status_return);
+}
+
+int XPutBackEvent(Display *display, XEvent *event) { (void)display; (void)event; return 0; }
+
+int XCloseDisplay(Display *display) { (void)display; return 0; }
+XIC XCreateIC(XIM im, ...) { (void)im; return NULL; }
+Status XCloseIM(XIM im) { (void)im; return 0; }
+Display *XDisplayOfIM(XIM im) { (void)im; return FAKE_DISPLAY; }
+char *XSetICValues(XIC ic, ...) { (void)ic; return NULL; }
+void XUnsetICFocus(XIC ic) { (void)ic; }
+void XSetICFocus(XIC ic) { (void)ic; }
+char *XSetIMValues(XIM im, ...) { (void)im; return NULL; }
+Bool XRegisterIMInstantiateCallback(Display *display, struct _XrmHashBucketRec *db, char *res_name, char *res_class, XIDProc callback, XPointer client_data) { (void)display; (void)db; (void)res_name; (void)res_class; (void)callback; (void)client_data; return True; }
+Bool XUnregisterIMInstantiateCallback(Display *display, struct _XrmHashBucketRec *db, char *res_name, char *res_class, XIDProc callback, XPointer client_data) { (void)display; (void)db; (void)res_name; (void)res_class; (void)callback; (void)client_data; return True; }
+void XDestroyIC(XIC ic) { (void)ic; }
+Status XInitThreads(void) { return True; }
+XIM XOpenIM(Display *display, XrmDatabase db, char *res_name, char *res_class) { (void)display; (void)db; (void)res_name; (void)res_class; return NULL; }
+char *XSetLocaleModifiers(const char *modifier_list) { (void)modifier_list; return ""; }
+Bool XSupportsLocale(void) { return True; }
+
+//
+// The shim's hooks, which we call.
+//
+static struct {
+  __typeof__(&XNextEvent) XNextEvent;
+  __typeof__(&XPending) XPending;
+  __typeof__(&XEventsQueued) XEventsQueued;
+  __typeof__(&XFilterEvent) XFilterEvent;
+  __typeof__(&Xutf8LookupString) Xutf8LookupString;
+  __typeof__(&XmbLookupString) XmbLookupString;
+  __typeof__(&XwcLookupString) XwcLookupString;
+  __typeof__(&XPeekEvent) XPeekEvent;
+  __typeof__(&XIfEvent) XIfEvent;
+  __typeof__(&XCheckIfEvent) XCheckIfEvent;
+  __typeof__(&XPeekIfEvent) XPeekIfEvent;
+  __typeof__(&XMaskEvent) XMaskEvent;
+  __typeof__(&XCheckMaskEvent) XCheckMaskEvent;
+  __typeof__(&XWindowEvent) XWindowEvent;
+  __typeof__(&XCheckWindowEvent) XCheckWindowEvent;
+  __typeof__(&XCheckTypedEvent) XCheckTypedEvent;
+  __typeof__(&XCheckTypedWindowEvent) XCheckTypedWindowEvent;
+  __typeof__(&XDestroyIC) XDestroyIC;
+  __typeof__(&XSetICFocus) XSetICFocus;
+  __typeof__(&XUnsetICFocus) XUnsetICFocus;
+  __typeof__(&XCloseDisplay) XCloseDisplay;
+} shim;
+
+static const char *func_names[MAX_TRACE_FUNC] = {
+  [FORCEIME_TRACE_XNextEvent] = "XNextEvent",
+  [FORCEIME_TRACE_XPending] = "XPending",
+  [FORCEIME_TRACE_XEventsQueued] = "XEventsQueued",
+  [FORCEIME_TRACE_Xutf8LookupString] = "Xutf8LookupString",
+  [FORCEIME_TRACE_XmbLookupString] = "XmbLookupString",
+  [FORCEIME_TRACE_XwcLookupString] = "XwcLookupString",
+  [FORCEIME_TRACE_XFilterEvent] = "XFilterEvent",
+  [FORCEIME_TRACE_XCheckTypedEvent] = "XCheckTypedEvent",
+  [FORCEIME_TRACE_XOpenIM] = "XOpenIM",
+  [FORCEIME_TRACE_XCreateIC] = "XCreateIC",
+  [FORCEIME_TRACE_XPeekEvent] = "XPeekEvent",
+  [FORCEIME_TRACE_XIfEvent] = "XIfEvent",
+  [FORCEIME_TRACE_XCheckIfEvent] = "XCheckIfEvent",
+  [FORCEIME_TRACE_XPeekIfEvent] = "XPeekIfEvent",
+  [FORCEIME_TRACE_XMaskEvent] = "XMaskEvent",
+  [FORCEIME_TRACE_XCheckMaskEvent] = "XCheckMaskEvent",
+  [FORCEIME_TRACE_XWindowEvent] = "XWindowEvent",
+  [FORCEIME_TRACE_XCheckWindowEvent] = "XCheckWindowEvent",
+  [FORCEIME_TRACE_XCheckTypedWindowEvent] = "XCheckTypedWindowEvent",
+  [FORCEIME_TRACE_XDestroyIC] = "XDestroyIC",
+  [FORCEIME_TRACE_XSetICFocus] = "XSetICFocus",
+  [FORCEIME_TRACE_XUnsetICFocus] = "XUnsetICFocus",
+  [FORCEIME_TRACE_XCloseDisplay] = "XCloseDisplay",
+};
+
+static uint64_t _now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void _sleep_until(uint64_t ns) {
+  struct timespec ts = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {}
+}
+
+static int mismatches = 0;
+
+static void _mismatch(const struct forceime_trace_record *r, const char *what, long long got, long long expected) {
+  mismatches++;
+  printf("%12.6f %s: %s was %lld, recorded %lld\n", r->ns / 1e9, func_names[r->func], what, got, expected);
+}
+
+static void _check_event(const struct forceime_trace_record *r, int result, const XEvent *event) {
+  if (result != r->result) { _mismatch(r, "result", result, r->result); }
+  if (event->type != r->event.type) { _mismatch(r, "event type", event->type, r->event.type); return; }
+  if (event->xany.window != r->event.window) { _mismatch(r, "window", event->xany.window, r->event.window); }
+  if ((event->type == KeyPress || event->type == KeyRelease) && event->xkey.keycode != r->event.keycode) {
+    _mismatch(r, "keycode", event->xkey.keycode, r->event.keycode);
+  }
+}
+
+// For the XCheck* calls. If nothing was found, whatever's in the event doesn't count.
+static void _check_found_event(const struct forceime_trace_record *r, Bool result, const XEvent *event) {
+  if (result != r->result) {
+    _mismatch(r, "result", result, r->result);
+  } else if (result) {
+    _check_event(r, result, event);
+  }
+}
+
+//
+// The program's predicate didn't make it into the trace, only what it picked. So this picks that.
+// If it picked nothing, this picks nothing.
+//
+static Bool _match_recorded(Display *display, XEvent *event, XPointer arg) {
+  (void)display;
+  const struct forceime_trace_record *r = (const struct forceime_trace_record *)arg;
+  if (r->func == FORCEIME_TRACE_XCheckIfEvent && !r->result) { return False; }
+  if (event->type != r->event.type || event->xany.window != r->event.window) { return False; }
+  return ((event->type != KeyPress && event->type != KeyRelease) || event->xkey.keycode == r->event.keycode);
+}
+
+static void _replay_call(const struct forceime_trace_record *r) {
+  XEvent event;
+  XIC ic = (XIC)(uintptr_t)r->ic;
+  switch (r->func) {
+    case FORCEIME_TRACE_XNextEvent: {
+      int result = shim.XNextEvent(FAKE_DISPLAY, &event);
+      _check_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XPeekEvent: {
+      int result = shim.XPeekEvent(FAKE_DISPLAY, &event);
+      _check_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XIfEvent: {
+      int result = shim.XIfEvent(FAKE_DISPLAY, &event, _match_recorded, (XPointer)r);
+      _check_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XCheckIfEvent: {
+      Bool result = shim.XCheckIfEvent(FAKE_DISPLAY, &event, _match_recorded, (XPointer)r);
+      _check_found_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XPeekIfEvent: {
+      int result = shim.XPeekIfEvent(FAKE_DISPLAY, &event, _match_recorded, (XPointer)r);
+      _check_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XMaskEvent: {
+      int result = shim.XMaskEvent(FAKE_DISPLAY, r->arg, &event);
+      _check_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XCheckMaskEvent: {
+      Bool result = shim.XCheckMaskEvent(FAKE_DISPLAY, r->arg, &event);
+      _check_found_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XCheckTypedEvent: {
+      Bool result = shim.XCheckTypedEvent(FAKE_DISPLAY, r->arg, &event);
+      _check_found_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XWindowEvent: {
+      int result = shim.XWindowEvent(FAKE_DISPLAY, r->event.window, r->arg, &event);
+      _check_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XCheckWindowEvent: {
+      Bool result = shim.XCheckWindowEvent(FAKE_DISPLAY, r->event.window, r->arg, &event);
+      _check_found_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XCheckTypedWindowEvent: {
+      Bool result = shim.XCheckTypedWindowEvent(FAKE_DISPLAY, r->event.window, r->arg, &event);
+      _check_found_event(r, result, &event);
+    } break;
+
+    case FORCEIME_TRACE_XDestroyIC:
+      shim.XDestroyIC(ic);
+      break;
+
+    case FORCEIME_TRACE_XSetICFocus:
+      shim.XSetICFocus(ic);
+      break;
+
+    case FORCEIME_TRACE_XUnsetICFocus:
+      shim.XUnsetICFocus(ic);
+      break;
+
+    case FORCEIME_TRACE_XCloseDisplay: {
+      int result = shim.XCloseDisplay(FAKE_DISPLAY);
+      if (result != r->result) { _mismatch(r, "result", result, r->result); }
+    } break;
+
+    case FORCEIME_TRACE_XPending: {
+      int result = shim.XPending(FAKE_DISPLAY);
+      if (result != r->result) { _mismatch(r, "result", result, r->result); }
+    } break;
+
+    case FORCEIME_TRACE_XEventsQueued: {
+      int result = shim.XEventsQueued(FAKE_DISPLAY, r->arg);
+      if (result != r->result) { _mismatch(r, "result", result, r->result); }
+    } break;
+
+    case FORCEIME_TRACE_XFilterEvent: {
+      _untrace_event(&event, &r->event);
+      Bool result = shim.XFilterEvent(&event, None);
+      if (result != r->result) { _mismatch(r, "result", result, r->result); }
+    } break;
+
+    case FORCEIME_TRACE_Xutf8LookupString:
+    case FORCEIME_TRACE_XmbLookupString:
+    case FORCEIME_TRACE_XwcLookupString: {
+      wchar_t buffer[256];
+      KeySym keysym;
+      Status status;
+      int result;
+      int unit_size = 1;
+      _untrace_event(&event, &r->event);
+      if (r->func == FORCEIME_TRACE_XwcLookupString) {
+        unit_size = sizeof(wchar_t);
+        result = shim.XwcLookupString(ic, &event.xkey, buffer, sizeof(buffer) / sizeof(buffer[0]), &keysym, &status);
+      } else if (r->func == FORCEIME_TRACE_XmbLookupString) {
+        result = shim.XmbLookupString(ic, &event.xkey, (char *)buffer, sizeof(buffer), &keysym, &status);
+      } else {
+        result = shim.Xutf8LookupString(ic, &event.xkey, (char *)buffer, sizeof(buffer), &keysym, &status);
+      }
+      if (result != r->result) { _mismatch(r, "result", result, r->result); break; }
+      if (status != r->arg) { _mismatch(r, "status", status, r->arg); }
+      if (r->payload_len > 0 && memcmp(buffer, r + 1, r->payload_len) != 0) {
+        mismatches++;
+        if (unit_size == 1) {
+          printf("%12.6f %s: got \"%.*s\", recorded \"%.*s\"\n", r->ns / 1e9, func_names[r->func],
+            result, (const char *)buffer, (int)r->payload_len, (const char *)(r + 1));
+        } else {
+          printf("%12.6f %s: got U+%04X, recorded U+%04X\n", r->ns / 1e9, func_names[r->func],
+            (unsigned)buffer[0], (unsigned)((const wchar_t *)(r + 1))[0]);
+        }
+      }
+    } break;
+
+    default:
+      break;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  double speed = 1.0;
+  int argi = 1;
+  if (argi + 1 < argc && !strcmp(argv[argi], "-s")) {
+    speed = atof(argv[argi + 1]);
+    argi += 2;
+  }
+  if (argi >= argc) {
+    fprintf(stderr, "usage: %s [-s speed] trace.bin [path/to/ForceIMESupport.so]\n", argv[0]);
+    return 2;
+  }
+  const char *trace_path = argv[argi];
+  const char *shim_path = (argi + 1 < argc ? argv[argi + 1] : "./ForceIMESupport.so");
+
+  int fd = open(trace_path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct forceime_trace_header)) {
+    fprintf(stderr, "%s: could not read trace \"%s\"\n", argv[0], trace_path);
+    return 2;
+  }
+  const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "%s: could not map trace \"%s\"\n", argv[0], trace_path);
+    return 2;
+  }
+  const struct forceime_trace_header *header = (const struct forceime_trace_header *)map;
+  if (memcmp(header->magic, FORCEIME_TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != FORCEIME_TRACE_VERSION) {
+    fprintf(stderr, "%s: \"%s\" isn't a version %d trace\n", argv[0], trace_path, FORCEIME_TRACE_VERSION);
+    return 2;
+  }
+  records_start = map + header->header_size;
+  records_end = records_start + header->used;
+  if (records_end > map + st.st_size) { records_end = map + st.st_size; }
+  for (int i = 0; i < MAX_TRACE_FUNC; i++) {
+    real_cursor[i] = records_start;
+  }
+
+  // Point the shim at us, and make sure it doesn't go recording over the top of what we're reading.
+  setenv("FORCEIME_XLIB", "", 1);
+  setenv("FORCEIME_RECORD", "", 1);
+  void *lib = dlopen(shim_path, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL) {
+    fprintf(stderr, "%s: could not load shim: %s\n", argv[0], dlerror());
+    return 2;
+  }
+#define X(name) \
+  shim.name = dlsym(lib, #name); \
+  if (shim.name == NULL) { fprintf(stderr, "%s: shim has no %s()\n", argv[0], #name); return 2; }
+  X(XNextEvent)
+  X(XPending)
+  X(XEventsQueued)
+  X(XFilterEvent)
+  X(Xutf8LookupString)
+  X(XmbLookupString)
+  X(XwcLookupString)
+  X(XPeekEvent)
+  X(XIfEvent)
+  X(XCheckIfEvent)
+  X(XPeekIfEvent)
+  X(XMaskEvent)
+  X(XCheckMaskEvent)
+  X(XWindowEvent)
+  X(XCheckWindowEvent)
+  X(XCheckTypedEvent)
+  X(XCheckTypedWindowEvent)
+  X(XDestroyIC)
+  X(XSetICFocus)
+  X(XUnsetICFocus)
+  X(XCloseDisplay)
+#undef X
+
+  int calls = 0;
+  uint64_t last_ns = 0;
+  uint64_t start_ns = _now_ns();
+  for (const char *p = records_start; ; ) {
+    const struct forceime_trace_record *r = _next_record(p);
+    if (r == NULL) { break; }
+    p += r->record_size;
+    if (r->kind != FORCEIME_TRACE_CALL) { continue; }
+
+    if (speed > 0.0) {
+      _sleep_until(start_ns + (uint64_t)(r->ns / speed));
+    }
+    _replay_call(r);
+    calls++;
+    last_ns = r->ns;
+  }
+  double elapsed = (_now_ns() - start_ns) / 1e9;
+
+  printf("replayed %d calls in %.3f s (recorded over %.3f s): %d mismatches, %d real calls not in the trace\n",
+    calls, elapsed, last_ns / 1e9, mismatches, real_exhausted);
+  if (header->dropped != 0) {
+    printf("warning: the recording dropped %llu records, so expect some mismatches\n", (unsigned long long)header->dropped);
+  }
+
+  return (mismatches == 0 && real_exhausted == 0 ? 0 : 1);
+}
@@ -0,0 +1,145 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMEStat
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// This shows what ForceIMESupport.so is up to in a running program, without stopping it or attaching anything to it.
+// The program needs to have been started with FORCEIME_LIVE_STATS=1. See ForceIMEStats.h for what gets counted.
+//
+// Usage:
+//   ./ForceIMEStat [-i seconds] [-n count] pid
+//
+// Every interval (default: 1 second), this prints each counter, and how fast it's gone up since last time.
+// -n stops after that many updates. The default is to keep going until the program exits, or you hit ^C.
+// Hooks which have never been called get left out.
+//
+
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ForceIMEStats.h"
+
+static uint64_t _now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t _load(const uint64_t *p) {
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void _print_counter(const char *name, uint64_t now, uint64_t before, double seconds) {
+  printf("  %-24s %14llu  %12.1f/s\n", name, (unsigned long long)now, (seconds > 0.0 ? (now - before) / seconds : 0.0));
+}
+
+int main(int argc, char *argv[]) {
+  double interval = 1.0;
+  long updates = -1;
+  int argi = 1;
+  for (; argi + 1 < argc; argi += 2) {
+    if (!strcmp(argv[argi], "-i")) {
+      interval = atof(argv[argi + 1]);
+    } else if (!strcmp(argv[argi], "-n")) {
+      updates = atol(argv[argi + 1]);
+    } else {
+      break;
+    }
+  }
+  if (argi + 1 != argc || interval <= 0.0) {
+    fprintf(stderr, "usage: %s [-i seconds] [-n count] pid\n", argv[0]);
+    return 2;
+  }
+  int pid = atoi(argv[argi]);
+
+  char name[32];
+  snprintf(name, sizeof(name), FORCEIME_STATS_NAME_FORMAT, pid);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "%s: no stats for pid %d - was it started with FORCEIME_LIVE_STATS=1?\n", argv[0], pid);
+    return 2;
+  }
+  const struct forceime_stats_page *page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    fprintf(stderr, "%s: could not map /dev/shm%s\n", argv[0], name);
+    return 2;
+  }
+  if (memcmp(page->magic, FORCEIME_STATS_MAGIC, sizeof(page->magic)) != 0 || page->version != FORCEIME_STATS_VERSION
+    || page->size < sizeof(*page) || page->hook_count > FORCEIME_STATS_MAX_HOOKS) {
+    fprintf(stderr, "%s: /dev/shm%s isn't a version %d stats page\n", argv[0], name, FORCEIME_STATS_VERSION);
+    return 2;
+  }
+
+  // Everything we print is a difference from this. The first time around, that's since the program started.
+  struct forceime_stats_page before;
+  memset(&before, 0, sizeof(before));
+  uint64_t before_ns = page->start_ns;
+
+  for (long n = 0; updates < 0 || n < updates; n++) {
+    if (n > 0) {
+      struct timespec delay = { (time_t)interval, (long)((interval - (time_t)interval) * 1e9) };
+      nanosleep(&delay, NULL);
+    }
+    uint64_t now_ns = _now_ns();
+    double seconds = (now_ns - before_ns) / 1e9;
+    before_ns = now_ns;
+
+    struct forceime_stats_page now;
+    memcpy(&now, page, sizeof(now));
+
+    printf("pid %d, up %.1f s\n", pid, (now_ns - page->start_ns) / 1e9);
+    printf(" hooks:\n");
+    for (uint32_t i = 0; i < now.hook_count; i++) {
+      uint64_t calls = _load(&page->hook_calls[i]);
+      if (calls != 0) {
+        _print_counter(now.hook_names[i], calls, before.hook_calls[i], seconds);
+      }
+      now.hook_calls[i] = calls;
+    }
+
+    printf(" events:\n");
+#define X(field) now.field = _load(&page->field); _print_counter(#field, now.field, before.field, seconds);
+    X(synthetic_events)
+    X(real_events)
+    printf(" text:\n");
+    X(chars_queued)
+    X(chars_delivered)
+    X(chars_dropped)
+    X(bytes_dropped)
+    printf(" overflows and drops:\n");
+    X(caller_overflows)
+    X(im_overflows)
+    X(log_dropped)
+    X(trace_dropped)
+    printf(" IM round trips:\n");
+    X(im_round_trips)
+    X(im_over_budget)
+#undef X
+    now.im_round_trip_ns = _load(&page->im_round_trip_ns);
+    printf("  %-24s %12.1f us  max %.1f us\n", "mean round trip",
+      (now.im_round_trips > 0 ? now.im_round_trip_ns / 1e3 / now.im_round_trips : 0.0), _load(&page->im_max_round_trip_ns) / 1e3);
+    printf(" queue: depth=%lld max=%llu\n\n",
+      (long long)__atomic_load_n(&page->queue_depth, __ATOMIC_RELAXED), (unsigned long long)_load(&page->max_queue_depth));
+    fflush(stdout);
+    before = now;
+
+    // The shim takes its page away when the program exits. Once that's happened, we're done.
+    if (kill(pid, 0) != 0) {
+      printf("pid %d has exited\n", pid);
+      break;
+    }
+  }
+
+  return 0;
+}
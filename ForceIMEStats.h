@@ -0,0 +1,63 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMESupport live statistics
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// With FORCEIME_LIVE_STATS=1, ForceIMESupport.so keeps one of these in a shared-memory page,
+// /dev/shm/forceime-<pid>, for as long as the program runs. ForceIMEStat reads it.
+//
+// The shim only ever adds to the counters, with relaxed atomics, and never locks anything.
+// So a reader just looks at them whenever it likes. Two counters read together might be a call or two apart, and that's fine.
+//
+// Everything is in native byte order, and a reader has to be built for the same sort of machine as the program.
+// The version goes up whenever anything here moves. Things only ever get added to the end, so size tells you what's there.
+//
+
+#ifndef FORCEIME_STATS_H
+#define FORCEIME_STATS_H
+
+#include <stdint.h>
+
+#define FORCEIME_STATS_MAGIC "FIMESTA\0"
+#define FORCEIME_STATS_VERSION 1
+#define FORCEIME_STATS_NAME_FORMAT "/forceime-%d" // For shm_open()
+
+#define FORCEIME_STATS_MAX_HOOKS 32
+#define FORCEIME_STATS_HOOK_NAME_BYTES 32
+
+struct forceime_stats_page {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;          // sizeof(struct forceime_stats_page), as the shim saw it
+  uint64_t pid;
+  uint64_t start_ns;      // CLOCK_MONOTONIC when the shim got loaded
+  uint32_t hook_count;
+  uint32_t reserved;
+  char hook_names[FORCEIME_STATS_MAX_HOOKS][FORCEIME_STATS_HOOK_NAME_BYTES];
+
+  // How many times the program called each hook. Hooks in FORCEIME_DISABLE only count calls that came through LD_PRELOAD.
+  // Calls from before the shim finished starting up (or before there was an Xlib to hook) don't count.
+  uint64_t hook_calls[FORCEIME_STATS_MAX_HOOKS];
+
+  uint64_t synthetic_events;   // KeyPress events we made up to hand out text
+  uint64_t real_events;        // Real events the program took from us
+  uint64_t chars_queued;       // Characters that went into our queues
+  uint64_t chars_delivered;    // Characters that came back out, one *LookupString() at a time
+  uint64_t chars_dropped;      // Characters thrown away, because their window or Display went away first
+  uint64_t bytes_dropped;      // Text we couldn't queue at all (out of memory, or it didn't convert)
+  uint64_t caller_overflows;   // Times the program's buffer was too small for the next character
+  uint64_t im_overflows;       // Times the IM had more text than it would give us, even with a bigger buffer
+  uint64_t log_dropped;        // Log messages that didn't fit in the ring
+  uint64_t trace_dropped;      // Trace records that didn't fit in the file
+
+  int64_t queue_depth;         // Characters queued right now, over every Display
+  uint64_t max_queue_depth;    // The most there have ever been
+
+  // Real XFilterEvent() and XCreateIC() calls, which can wait on the IM server. Only counted if the shim is timing them.
+  uint64_t im_round_trips;
+  uint64_t im_round_trip_ns;     // All of them added up
+  uint64_t im_max_round_trip_ns; // The slowest
+  uint64_t im_over_budget;       // Calls over FORCEIME_IM_BUDGET_US
+};
+
+#endif
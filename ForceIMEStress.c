@@ -0,0 +1,268 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMEStress
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// This hammers ForceIMESupport.so from several threads at once, on top of ForceIMEStubXlib.so (see ForceIMEStubXlib.h),
+// and checks that every committed character comes out exactly once.
+//
+// Usage:
+//   ./ForceIMEStress [-t threads] [-c commits] [-w windows] [path/to/ForceIMESupport.so]
+//
+// We call XInitThreads() first, like a multithreaded program has to (and libX11 1.8 does anyway), then start the threads:
+// - One in three only polls: XPending() and XEventsQueued(), as fast as it can.
+// - The rest poll too, and take whatever's there: XNextEvent(), XFilterEvent(), Xutf8LookupString().
+//   They don't care which window an event is for, so they're all fighting over the same queues.
+// Meanwhile, this thread commits text to each window (default: 24 of them), 2000 commits in all by default.
+// That's more windows than the shim has room for (16), so windows keep getting evicted and their queues handed to other ones.
+// A window gets its next commit once all of its last one has come out. A real IM only ever has one commit on the go per IC,
+// and any more than that, the shim would drop. Some KeyRelease, ClientMessage and FocusIn events get mixed in as well.
+//
+// Exits with 0 if every character turned up, once, on the right window. 1 if not, and 2 if it couldn't run at all.
+// The shim's settings come from the environment as usual, so e.g. FORCEIME_DELIVERY=paced ./ForceIMEStress tests that.
+//
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dlfcn.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "ForceIMEStubXlib.h"
+
+#define FORCEIME_STRESS_FUNCTIONS(X) \
+  X(XCreateIC) \
+  X(XEventsQueued) \
+  X(XFilterEvent) \
+  X(XInitThreads) \
+  X(XNextEvent) \
+  X(XOpenIM) \
+  X(XPending) \
+  X(Xutf8LookupString)
+
+static struct {
+#define X(name) __typeof__(&name) name;
+  FORCEIME_STRESS_FUNCTIONS(X)
+#undef X
+} shim;
+
+static const char *texts[] = {
+  "a",
+  "hello",
+  "日本語",
+  "漢字を入力しています。",
+  "😀👍",
+  "Mixed 混合 text ✓",
+};
+#define TEXT_COUNT ((int)(sizeof(texts) / sizeof(texts[0])))
+
+#define MAX_WINDOWS 64
+static Display *display = NULL;
+static XIC ics[MAX_WINDOWS + 1];
+
+// What each window has been sent, and what's come out. Windows are numbered from 1.
+struct window_tally {
+  uint64_t chars;
+  uint64_t sum; // Of the code points, so a character coming out mangled shows up too
+};
+static struct window_tally sent[MAX_WINDOWS + 1];
+static struct window_tally received[MAX_WINDOWS + 1];
+static int window_count = 24;
+static int stop = 0;
+static uint64_t bad_windows = 0;
+
+static uint64_t _now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Adds up some valid UTF-8. Returns how many characters it was.
+static uint64_t _tally_utf8(const unsigned char *s, int len, uint64_t *sum) {
+  uint64_t chars = 0;
+  for (int i = 0; i < len; ) {
+    unsigned int c = s[i++];
+    int more = (c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0);
+    c &= (more == 3 ? 0x07 : more == 2 ? 0x0F : more == 1 ? 0x1F : 0x7F);
+    for (; more > 0 && i < len; more--) {
+      c = (c << 6) | (s[i++] & 0x3F);
+    }
+    *sum += c;
+    chars++;
+  }
+  return chars;
+}
+
+static void _poll(void) {
+  (void)shim.XPending(display);
+  (void)shim.XEventsQueued(display, QueuedAlready);
+  (void)shim.XEventsQueued(display, QueuedAfterReading);
+}
+
+static void *_poller(void *arg) {
+  (void)arg;
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    _poll();
+  }
+  return NULL;
+}
+
+static void *_consumer(void *arg) {
+  (void)arg;
+  char small[64];
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    _poll();
+    if (shim.XPending(display) == 0) { continue; }
+    XEvent event;
+    shim.XNextEvent(display, &event);
+    if (shim.XFilterEvent(&event, 0) || event.type != KeyPress) { continue; }
+    Window w = event.xkey.window;
+    if (w < 1 || w > (Window)window_count) { continue; } // The idle event, if somebody else got there first
+
+    // Just like a program should: if it's too big, ask again with enough room.
+    KeySym keysym;
+    Status status;
+    char *buf = small;
+    int len = shim.Xutf8LookupString(ics[w], &event.xkey, buf, sizeof(small), &keysym, &status);
+    if (status == XBufferOverflow) {
+      buf = malloc(len);
+      if (buf == NULL) { abort(); }
+      len = shim.Xutf8LookupString(ics[w], &event.xkey, buf, len, &keysym, &status);
+    }
+    if (status == XLookupChars || status == XLookupBoth) {
+      uint64_t sum = 0;
+      uint64_t chars = _tally_utf8((const unsigned char *)buf, len, &sum);
+      __atomic_add_fetch(&received[w].sum, sum, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&received[w].chars, chars, __ATOMIC_RELEASE);
+    }
+    if (buf != small) { free(buf); }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int thread_count = 6;
+  long commits = 2000;
+  int argi = 1;
+  for (; argi + 1 < argc; argi += 2) {
+    if (!strcmp(argv[argi], "-t")) {
+      thread_count = atoi(argv[argi + 1]);
+    } else if (!strcmp(argv[argi], "-c")) {
+      commits = atol(argv[argi + 1]);
+    } else if (!strcmp(argv[argi], "-w")) {
+      window_count = atoi(argv[argi + 1]);
+    } else {
+      break;
+    }
+  }
+  if (argc > argi + 1 || thread_count < 2 || commits < 1 || window_count < 1 || window_count > MAX_WINDOWS) {
+    fprintf(stderr, "usage: %s [-t threads] [-c commits] [-w windows] [path/to/ForceIMESupport.so]\n", argv[0]);
+    return 2;
+  }
+  const char *shim_path = (argi < argc ? argv[argi] : "./ForceIMESupport.so");
+
+  // The shim has to take its real functions from the very same stub we're linked against.
+  Dl_info stub_info;
+  if (!dladdr((void *)forceime_stub_display, &stub_info) || stub_info.dli_fname == NULL) {
+    fprintf(stderr, "%s: could not find ForceIMEStubXlib.so\n", argv[0]);
+    return 2;
+  }
+  setenv("FORCEIME_XLIB", stub_info.dli_fname, 1);
+  setenv("FORCEIME_RECORD", "", 1);
+  setenv("FORCEIME_LOG", "warn", 0);
+  void *lib = dlopen(shim_path, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL) {
+    fprintf(stderr, "%s: could not load shim: %s\n", argv[0], dlerror());
+    return 2;
+  }
+#define X(name) \
+  shim.name = dlsym(lib, #name); \
+  if (shim.name == NULL) { \
+    fprintf(stderr, "%s: shim has no %s()\n", argv[0], #name); \
+    return 2; \
+  }
+  FORCEIME_STRESS_FUNCTIONS(X)
+#undef X
+
+  shim.XInitThreads();
+  display = forceime_stub_display();
+  XIM im = shim.XOpenIM(display, NULL, NULL, NULL);
+  for (Window w = 1; w <= (Window)window_count; w++) {
+    ics[w] = shim.XCreateIC(im, XNInputStyle, XIMPreeditNothing | XIMStatusNothing, XNClientWindow, w, XNFocusWindow, w, NULL);
+    if (ics[w] == NULL) {
+      fprintf(stderr, "%s: could not set up an IC\n", argv[0]);
+      return 2;
+    }
+  }
+
+  pthread_t threads[thread_count];
+  for (int i = 0; i < thread_count; i++) {
+    if (pthread_create(&threads[i], NULL, (i % 3 == 0 ? _poller : _consumer), NULL) != 0) {
+      fprintf(stderr, "%s: could not start threads\n", argv[0]);
+      return 2;
+    }
+  }
+
+  // Keep every window busy until we've sent everything. Give up if nothing's come out for a while.
+  uint64_t start_ns = _now_ns();
+  uint64_t progress_ns = start_ns;
+  long committed = 0;
+  int noise_types[] = { KeyRelease, ClientMessage, FocusIn };
+  Bool stuck = False;
+  for (;;) {
+    Bool all_done = True;
+    for (Window w = 1; w <= (Window)window_count; w++) {
+      if (__atomic_load_n(&received[w].chars, __ATOMIC_ACQUIRE) < sent[w].chars) {
+        all_done = False;
+        continue;
+      }
+      if (committed == commits) { continue; }
+      all_done = False;
+      const char *text = texts[committed % TEXT_COUNT];
+      sent[w].chars += _tally_utf8((const unsigned char *)text, strlen(text), &sent[w].sum);
+      forceime_stub_commit(w, 38, text);
+      XEvent noise;
+      memset(&noise, 0, sizeof(noise));
+      noise.type = noise_types[committed % 3];
+      noise.xany.window = w;
+      forceime_stub_push_event(&noise);
+      committed++;
+      progress_ns = _now_ns();
+    }
+    if (all_done) { break; }
+    uint64_t now = _now_ns();
+    if (now - progress_ns > 5000000000ull) {
+      stuck = True;
+      break;
+    }
+    struct timespec delay = { 0, 10000 };
+    nanosleep(&delay, NULL);
+  }
+
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  uint64_t total = 0;
+  for (Window w = 1; w <= (Window)window_count; w++) {
+    total += sent[w].chars;
+    if (received[w].chars != sent[w].chars || received[w].sum != sent[w].sum) {
+      printf("window %lu: sent %llu characters, got %llu%s\n", w, (unsigned long long)sent[w].chars,
+        (unsigned long long)received[w].chars, (received[w].chars == sent[w].chars ? ", but not the same ones" : ""));
+      bad_windows++;
+    }
+  }
+  printf("%d threads, %ld commits, %llu characters over %d windows in %.2f s: %s\n", thread_count, committed,
+    (unsigned long long)total, window_count, (_now_ns() - start_ns) / 1e9,
+    (bad_windows == 0 && !stuck ? "ok" : stuck ? "STUCK" : "MISMATCH"));
+  return (bad_windows == 0 && !stuck ? 0 : 1);
+}
@@ -0,0 +1,523 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMEStubXlib
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// A fake Xlib for testing and benchmarking ForceIMESupport.so without an X server. See ForceIMEStubXlib.h.
+//
+// This has to provide every Xlib function the shim looks up (FORCEIME_HOOKS and FORCEIME_IMPORTS in ForceIMESupport.c),
+// or the shim won't load.
+//
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xresource.h>
+
+#include "ForceIMEStubXlib.h"
+
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// The shim only uses the Display pointer to tell Displays apart, so any unique address will do.
+//
+static char fake_display_storage;
+#define FAKE_DISPLAY ((Display *)&fake_display_storage)
+
+#define MAX_EVENTS 4096
+static XEvent events[MAX_EVENTS];
+static int event_count = 0;
+static XEvent idle_event = { .xmotion = { .type = MotionNotify, .display = FAKE_DISPLAY } };
+static unsigned long next_serial = 1;
+
+//
+// Text waiting to be looked up, by the serial of the KeyPress it came with.
+//
+#define MAX_COMMITS 4096
+struct commit {
+  unsigned long serial;
+  char *text;
+};
+static struct commit commits[MAX_COMMITS];
+static int commit_count = 0;
+
+static unsigned int im_delay_us = 0;
+
+Display *forceime_stub_display(void) {
+  return FAKE_DISPLAY;
+}
+
+void forceime_stub_reset(void) {
+  pthread_mutex_lock(&stub_lock);
+  event_count = 0;
+  for (int i = 0; i < commit_count; i++) {
+    free(commits[i].text);
+  }
+  commit_count = 0;
+  pthread_mutex_unlock(&stub_lock);
+}
+
+// Only call this with stub_lock held!
+static void _push_event_locked(const XEvent *event) {
+  if (event_count == MAX_EVENTS) {
+    fprintf(stderr, "ForceIMEStubXlib: event queue is full\n");
+    abort();
+  }
+  XEvent *e = &events[event_count++];
+  *e = *event;
+  if (e->xany.display == NULL) { e->xany.display = FAKE_DISPLAY; }
+  if (e->xany.serial == 0) { e->xany.serial = next_serial++; }
+}
+
+void forceime_stub_push_event(const XEvent *event) {
+  pthread_mutex_lock(&stub_lock);
+  _push_event_locked(event);
+  pthread_mutex_unlock(&stub_lock);
+}
+
+void forceime_stub_set_idle_event(const XEvent *event) {
+  pthread_mutex_lock(&stub_lock);
+  idle_event = *event;
+  if (idle_event.xany.display == NULL) { idle_event.xany.display = FAKE_DISPLAY; }
+  pthread_mutex_unlock(&stub_lock);
+}
+
+void forceime_stub_commit(Window window, unsigned int keycode, const char *text) {
+  XEvent event;
+  memset(&event, 0, sizeof(event));
+  event.xkey.type = KeyPress;
+  event.xkey.window = window;
+  event.xkey.keycode = keycode;
+
+  pthread_mutex_lock(&stub_lock);
+  if (commit_count == MAX_COMMITS) {
+    fprintf(stderr, "ForceIMEStubXlib: too many commits waiting\n");
+    abort();
+  }
+  _push_event_locked(&event);
+  commits[commit_count].serial = events[event_count - 1].xany.serial;
+  commits[commit_count].text = strdup(text);
+  commit_count++;
+  pthread_mutex_unlock(&stub_lock);
+}
+
+int forceime_stub_queued(void) {
+  pthread_mutex_lock(&stub_lock);
+  int count = event_count;
+  pthread_mutex_unlock(&stub_lock);
+  return count;
+}
+
+void forceime_stub_set_im_delay_us(unsigned int us) {
+  __atomic_store_n(&im_delay_us, us, __ATOMIC_RELAXED);
+}
+
+static void _im_delay(void) {
+  unsigned int us = __atomic_load_n(&im_delay_us, __ATOMIC_RELAXED);
+  if (us != 0) {
+    struct timespec delay = { us / 1000000, (long)(us % 1000000) * 1000 };
+    nanosleep(&delay, NULL);
+  }
+}
+
+//
+// The event queue.
+//
+static long _event_mask(int type) {
+  switch (type) {
+    case KeyPress: return KeyPressMask;
+    case KeyRelease: return KeyReleaseMask;
+    case ButtonPress: return ButtonPressMask;
+    case ButtonRelease: return ButtonReleaseMask;
+    case MotionNotify: return PointerMotionMask | ButtonMotionMask;
+    case EnterNotify: return EnterWindowMask;
+    case LeaveNotify: return LeaveWindowMask;
+    case FocusIn: case FocusOut: return FocusChangeMask;
+    case Expose: return ExposureMask;
+    case ConfigureNotify: case MapNotify: case UnmapNotify: case DestroyNotify: return StructureNotifyMask;
+    default: return 0; // Like ClientMessage, which no mask selects
+  }
+}
+
+enum match_kind {
+  MATCH_ANY,
+  MATCH_TYPE,
+  MATCH_MASK,
+  MATCH_WINDOW_TYPE,
+  MATCH_WINDOW_MASK,
+  MATCH_PREDICATE,
+};
+struct match {
+  enum match_kind kind;
+  int type;
+  long mask;
+  Window window;
+  Bool (*predicate)(Display *, XEvent *, XPointer);
+  XPointer arg;
+};
+
+static Bool _matches(const struct match *m, XEvent *event) {
+  switch (m->kind) {
+    case MATCH_ANY: return True;
+    case MATCH_TYPE: return event->type == m->type;
+    case MATCH_MASK: return (_event_mask(event->type) & m->mask) != 0;
+    case MATCH_WINDOW_TYPE: return event->xany.window == m->window && event->type == m->type;
+    case MATCH_WINDOW_MASK: return event->xany.window == m->window && (_event_mask(event->type) & m->mask) != 0;
+    case MATCH_PREDICATE: return m->predicate(FAKE_DISPLAY, event, m->arg);
+  }
+  return False;
+}
+
+//
+// Takes (or just copies) the first queued event that matches.
+// With wait set, the idle event stands in for whatever we'd have waited for. If it wouldn't have done, we'd wait forever.
+//
+static Bool _take_event(const struct match *m, XEvent *event_return, Bool remove, Bool wait) {
+  pthread_mutex_lock(&stub_lock);
+  for (int i = 0; i < event_count; i++) {
+    if (_matches(m, &events[i])) {
+      *event_return = events[i];
+      if (remove) {
+        memmove(&events[i], &events[i + 1], (event_count - i - 1) * sizeof(XEvent));
+        event_count--;
+      }
+      pthread_mutex_unlock(&stub_lock);
+      return True;
+    }
+  }
+  XEvent idle = idle_event;
+  pthread_mutex_unlock(&stub_lock);
+
+  if (!wait) { return False; }
+  if (!_matches(m, &idle)) {
+    fprintf(stderr, "ForceIMEStubXlib: would wait forever for an event\n");
+    abort();
+  }
+  *event_return = idle;
+  return True;
+}
+
+int XNextEvent(Display *display, XEvent *event_return) {
+  (void)display;
+  struct match m = { .kind = MATCH_ANY };
+  _take_event(&m, event_return, True, True);
+  return 0;
+}
+
+int XPeekEvent(Display *display, XEvent *event_return) {
+  (void)display;
+  struct match m = { .kind = MATCH_ANY };
+  _take_event(&m, event_return, False, True);
+  return 0;
+}
+
+int XIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  (void)display;
+  struct match m = { .kind = MATCH_PREDICATE, .predicate = predicate, .arg = arg };
+  _take_event(&m, event_return, True, True);
+  return 0;
+}
+
+int XPeekIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  (void)display;
+  struct match m = { .kind = MATCH_PREDICATE, .predicate = predicate, .arg = arg };
+  _take_event(&m, event_return, False, True);
+  return 0;
+}
+
+int XMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  (void)display;
+  struct match m = { .kind = MATCH_MASK, .mask = event_mask };
+  _take_event(&m, event_return, True, True);
+  return 0;
+}
+
+int XWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  (void)display;
+  struct match m = { .kind = MATCH_WINDOW_MASK, .window = w, .mask = event_mask };
+  _take_event(&m, event_return, True, True);
+  return 0;
+}
+
+Bool XCheckIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  (void)display;
+  struct match m = { .kind = MATCH_PREDICATE, .predicate = predicate, .arg = arg };
+  return _take_event(&m, event_return, True, False);
+}
+
+Bool XCheckMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  (void)display;
+  struct match m = { .kind = MATCH_MASK, .mask = event_mask };
+  return _take_event(&m, event_return, True, False);
+}
+
+Bool XCheckTypedEvent(Display *display, int event_type, XEvent *event_return) {
+  (void)display;
+  struct match m = { .kind = MATCH_TYPE, .type = event_type };
+  return _take_event(&m, event_return, True, False);
+}
+
+Bool XCheckTypedWindowEvent(Display *display, Window w, int event_type, XEvent *event_return) {
+  (void)display;
+  struct match m = { .kind = MATCH_WINDOW_TYPE, .window = w, .type = event_type };
+  return _take_event(&m, event_return, True, False);
+}
+
+Bool XCheckWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  (void)display;
+  struct match m = { .kind = MATCH_WINDOW_MASK, .window = w, .mask = event_mask };
+  return _take_event(&m, event_return, True, False);
+}
+
+int XPutBackEvent(Display *display, XEvent *event) {
+  (void)display;
+  pthread_mutex_lock(&stub_lock);
+  if (event_count == MAX_EVENTS) {
+    fprintf(stderr, "ForceIMEStubXlib: event queue is full\n");
+    abort();
+  }
+  memmove(&events[1], &events[0], event_count * sizeof(XEvent));
+  events[0] = *event;
+  event_count++;
+  pthread_mutex_unlock(&stub_lock);
+  return 0;
+}
+
+int XPending(Display *display) {
+  (void)display;
+  return forceime_stub_queued();
+}
+
+int XEventsQueued(Display *display, int mode) {
+  (void)display;
+  (void)mode;
+  return forceime_stub_queued();
+}
+
+int XCloseDisplay(Display *display) {
+  (void)display;
+  return 0;
+}
+
+Status XInitThreads(void) {
+  return True;
+}
+
+//
+// Looking up text.
+//
+
+// Takes the text that came with this event, if it's not too big for the buffer. needed gets how big it is.
+// Only call this with stub_lock held! The caller frees what it gets.
+static char *_take_commit_locked(const XKeyPressedEvent *event, size_t room, size_t (*size_of)(const char *), size_t *needed) {
+  for (int i = 0; i < commit_count; i++) {
+    if (commits[i].serial != event->serial) { continue; }
+    char *text = commits[i].text;
+    *needed = size_of(text);
+    if (*needed > room) { return NULL; }
+    commits[i] = commits[--commit_count];
+    return text;
+  }
+  *needed = 0;
+  return NULL;
+}
+
+static size_t _utf8_size(const char *text) {
+  return strlen(text);
+}
+
+// Only what the stress tests and benchmarks send: valid UTF-8.
+static size_t _utf8_decode(const char *text, wchar_t *out) {
+  size_t count = 0;
+  const unsigned char *s = (const unsigned char *)text;
+  while (*s != '\0') {
+    unsigned int c = *s++;
+    int more = (c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0);
+    c &= (more == 3 ? 0x07 : more == 2 ? 0x0F : more == 1 ? 0x1F : 0x7F);
+    for (; more > 0 && *s != '\0'; more--) {
+      c = (c << 6) | (*s++ & 0x3F);
+    }
+    if (out != NULL) { out[count] = (wchar_t)c; }
+    count++;
+  }
+  return count;
+}
+
+static size_t _wc_size(const char *text) {
+  return _utf8_decode(text, NULL);
+}
+
+static int _lookup_bytes(XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) {
+  size_t needed;
+  pthread_mutex_lock(&stub_lock);
+  char *text = _take_commit_locked(event, (size_t)bytes_buffer, _utf8_size, &needed);
+  pthread_mutex_unlock(&stub_lock);
+  if (keysym_return != NULL) { *keysym_return = NoSymbol; }
+  if (text == NULL) {
+    if (status_return != NULL) { *status_return = (needed > 0 ? XBufferOverflow : XLookupNone); }
+    return (int)needed;
+  }
+  memcpy(buffer_return, text, needed);
+  free(text);
+  if (status_return != NULL) { *status_return = XLookupChars; }
+  return (int)needed;
+}
+
+int Xutf8LookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) {
+  (void)ic;
+  return _lookup_bytes(event, buffer_return, bytes_buffer, keysym_return, status_return);
+}
+
+// The stub's locale is always UTF-8.
+int XmbLookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) {
+  (void)ic;
+  return _lookup_bytes(event, buffer_return, bytes_buffer, keysym_return, status_return);
+}
+
+int XwcLookupString(XIC ic, XKeyPressedEvent *event, wchar_t *buffer_return, int wchars_buffer, KeySym *keysym_return, Status *status_return) {
+  (void)ic;
+  size_t needed;
+  pthread_mutex_lock(&stub_lock);
+  char *text = _take_commit_locked(event, (size_t)wchars_buffer, _wc_size, &needed);
+  pthread_mutex_unlock(&stub_lock);
+  if (keysym_return != NULL) { *keysym_return = NoSymbol; }
+  if (text == NULL) {
+    if (status_return != NULL) { *status_return = (needed > 0 ? XBufferOverflow : XLookupNone); }
+    return (int)needed;
+  }
+  _utf8_decode(text, buffer_return);
+  free(text);
+  if (status_return != NULL) { *status_return = XLookupChars; }
+  return (int)needed;
+}
+
+//
+// IMs and ICs.
+//
+struct stub_im {
+  Display *display;
+};
+
+struct stub_ic {
+  struct stub_im *im;
+  XIMStyle style;
+  Window client_window;
+  Window focus_window;
+  Bool focused;
+};
+
+Bool XFilterEvent(XEvent *event, Window w) {
+  (void)event;
+  (void)w;
+  _im_delay();
+  return False;
+}
+
+XIM XOpenIM(Display *display, XrmDatabase db, char *res_name, char *res_class) {
+  (void)db;
+  (void)res_name;
+  (void)res_class;
+  struct stub_im *im = calloc(1, sizeof(*im));
+  if (im != NULL) { im->display = display; }
+  return (XIM)im;
+}
+
+Status XCloseIM(XIM im) {
+  free(im);
+  return True;
+}
+
+Display *XDisplayOfIM(XIM im) {
+  return ((struct stub_im *)im)->display;
+}
+
+// Only the values the shim ever sets.
+static void _ic_values(struct stub_ic *ic, va_list ap) {
+  for (;;) {
+    const char *name = va_arg(ap, const char *);
+    if (name == NULL) { break; }
+    if (!strcmp(name, XNInputStyle)) {
+      ic->style = va_arg(ap, XIMStyle);
+    } else if (!strcmp(name, XNClientWindow)) {
+      ic->client_window = va_arg(ap, Window);
+    } else if (!strcmp(name, XNFocusWindow)) {
+      ic->focus_window = va_arg(ap, Window);
+    } else {
+      (void)va_arg(ap, void *);
+    }
+  }
+}
+
+XIC XCreateIC(XIM im, ...) {
+  _im_delay();
+  struct stub_ic *ic = calloc(1, sizeof(*ic));
+  if (ic == NULL) { return NULL; }
+  ic->im = (struct stub_im *)im;
+  va_list ap;
+  va_start(ap, im);
+  _ic_values(ic, ap);
+  va_end(ap);
+  return (XIC)ic;
+}
+
+char *XSetICValues(XIC ic, ...) {
+  va_list ap;
+  va_start(ap, ic);
+  _ic_values((struct stub_ic *)ic, ap);
+  va_end(ap);
+  return NULL;
+}
+
+void XDestroyIC(XIC ic) {
+  free(ic);
+}
+
+void XSetICFocus(XIC ic) {
+  ((struct stub_ic *)ic)->focused = True;
+}
+
+void XUnsetICFocus(XIC ic) {
+  ((struct stub_ic *)ic)->focused = False;
+}
+
+char *XSetIMValues(XIM im, ...) {
+  (void)im;
+  return NULL;
+}
+
+Bool XRegisterIMInstantiateCallback(Display *display, struct _XrmHashBucketRec *db, char *res_name, char *res_class, XIDProc callback, XPointer client_data) {
+  (void)display;
+  (void)db;
+  (void)res_name;
+  (void)res_class;
+  (void)callback;
+  (void)client_data;
+  return True;
+}
+
+Bool XUnregisterIMInstantiateCallback(Display *display, struct _XrmHashBucketRec *db, char *res_name, char *res_class, XIDProc callback, XPointer client_data) {
+  (void)display;
+  (void)db;
+  (void)res_name;
+  (void)res_class;
+  (void)callback;
+  (void)client_data;
+  return True;
+}
+
+char *XSetLocaleModifiers(const char *modifier_list) {
+  (void)modifier_list;
+  return "";
+}
+
+Bool XSupportsLocale(void) {
+  return True;
+}
@@ -0,0 +1,47 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMEStubXlib
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// ForceIMEStubXlib.so is a fake Xlib, just big enough for ForceIMESupport.so to run on top of without an X server.
+// Point FORCEIME_XLIB at it, and the shim takes its "real" functions from here. ForceIMEBench and ForceIMEStress do.
+//
+// There's one Display, with one event queue. A test puts events in it, and the usual functions take them back out.
+// Waiting for an event never waits - if there's nothing queued, you get the idle event instead. (Default: MotionNotify on window 0)
+//
+// An IME commit is a KeyPress with some text attached. *LookupString() on that KeyPress gives the text, once,
+// the same way a real IM does: too small a buffer gets XBufferOverflow and how much room it needs.
+// Any other KeyPress looks up as nothing at all.
+//
+// IMs and ICs are just pointers to something. No IM server ever turns up, so FORCEIME_ASYNC_IM stays local forever.
+//
+// Everything here is guarded by one lock, so it's as thread-safe as Xlib after XInitThreads(), and about as fast as a stub can be.
+//
+
+#ifndef FORCEIME_STUB_XLIB_H
+#define FORCEIME_STUB_XLIB_H
+
+#include <X11/Xlib.h>
+
+// The one and only Display.
+Display *forceime_stub_display(void);
+
+// Throws away every queued event and commit.
+void forceime_stub_reset(void);
+
+// Adds an event to the end of the queue. display and serial get filled in if they're not set.
+void forceime_stub_push_event(const XEvent *event);
+
+// What you get from XNextEvent() and friends when nothing's queued.
+void forceime_stub_set_idle_event(const XEvent *event);
+
+// Queues a KeyPress for window, which *LookupString() turns into text (UTF-8).
+void forceime_stub_commit(Window window, unsigned int keycode, const char *text);
+
+// How many events are queued.
+int forceime_stub_queued(void);
+
+// Makes XFilterEvent() and XCreateIC() take this long, like a slow IM server would.
+void forceime_stub_set_im_delay_us(unsigned int us);
+
+#endif
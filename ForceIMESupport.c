@@ -14,311 +14,3920 @@
 // Here's what this does:
 //
 // - Prior to calling XOpenIM(), we set the locale up so that your IME knows it can be used.
+//   - With FORCEIME_ASYNC_IM=1, XOpenIM() doesn't wait for the IM server. The program gets a local IM until the real one is ready.
 //
 // - We intercept XCreateIC() to ensure that it gives a "preedit nothing" context, which means that the IME can actually be used. (If you asked for PreeditNone, you probably can't handle preedit information.)
 //
 // - Some poorly-written software (e.g. Unity) calls Xutf8LookupString(), expecting it to return only one character, and then it proceeds to ignore the rest.
-//   - We have a buffer for this which acts somewhat like a back-to-back pair of FIFO queue.
+//   (The same goes for XmbLookupString() and XwcLookupString(), which share the same buffers.)
+//   - We have a head/tail ring buffer for this, so handing out each character is O(1) and never shuffles the rest of the text around.
+//   - Each window on each Display gets its own buffer, so text doesn't leak between windows.
 //   - We return 1 character, and then while this buffer still has stuff, we mess with other calls:
 //     - XPending() returns True.
 //     - XEventsQueued() returns 1 more than what's actually there.
+//     - (With FORCEIME_DELIVERY=burst, those two count every character we have left instead.
+//        With FORCEIME_DELIVERY=paced, they count however many fit the program's frame rate.)
 //     - XFilterEvent() returns False if it's a KeyPress event with a keycode of None.
 //     - XNextEvent() returns a dummy KeyPress with a keycode of None.
+//       - Important real events (KeyRelease, FocusOut, ...) get pulled out ahead of these, and nothing else waits too long.
+//     - XPeekEvent(), XCheckTypedEvent(), XIfEvent(), XMaskEvent() and the rest of that family see the same events XNextEvent() would.
+//
+// Every FORCEIME_* setting can also go in a file - see "Configuration" below.
+// Any of the hooks can be turned off with FORCEIME_DISABLE, if you want to see what one is costing you.
+// With FORCEIME_LIVE_STATS=1, ForceIMEStat can show you what we're doing while the program runs.
 //
 // I wouldn't call this particularly well-written at this point. But at least it does a better job of input than Unity does.
 //
 // KNOWN PROBLEMS:
-// - If Unity has a low framerate, the event queue we present as XNextEvent() can get backlogged, even when a text field isn't focused. This means that a KeyRelease event can take many frames to actually arrive.
-//   - We should probably be using something like XCheckMaskEvent() to grab KeyRelease events.
+// - If Unity has a low framerate, the event queue we present as XNextEvent() can get backlogged, even when a text field isn't focused.
+//   - This used to mean that a KeyRelease event could take many frames to actually arrive. We now pull those out with XCheckTypedEvent() first.
 //   - NOTE: Unity handles mouse input via other means - that is, it doesn't use classic X11 for this (I'm guessing XInput2). TODO: Find out how, because Unity has plenty of bugs here, too! --GM
 //
 
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/Xresource.h>
+#include <langinfo.h>
 #include <locale.h>
+#include <wchar.h>
+
+#include "ForceIMEStats.h"
+#include "ForceIMETrace.h"
 
 //
-// When calling Xutf8LookupString:
-// Unity 2019 accepts as much data as it can, but then only uses the first character.
-// This is NOT how an IME behaves on Linux - you get multiple characters in one call.
+// USDT probes, for bpftrace, perf, SystemTap and friends. e.g.:
+//   bpftrace -e 'usdt:./ForceIMESupport.so:forceime:enqueue { printf("%d chars, %d queued\n", arg2, arg0); }' -p <pid>
 //
-// We need to create a buffer to work around this.
+// Every probe has the same three arguments:
+// - arg0: how many characters are queued right now, over every Display (the same as queue_depth in ForceIMEStats.h)
+// - arg1: the type of the event involved (KeyPress, ...), or 0 if there isn't one
+// - arg2: whatever else is interesting. For the *_return probes, that's what the hook returned.
+//
+// The probes are:
+// - <hook>_entry and <hook>_return, for Xutf8LookupString, XNextEvent, XFilterEvent, XPending, XEventsQueued, XCreateIC and XOpenIM.
+// - enqueue: an IM gave us text. arg2 is how many characters.
+// - dequeue: we handed a character over. arg2 is how many bytes it was.
+// - overflow: the program's buffer was too small for the next character. arg2 is how much room it needed.
+// - im_overflow: the IM had more text than it would give us, even with more room. arg2 is how much it said it had.
+// - synthetic: we handed out a made-up KeyPress. arg2 is how many characters that window has left.
+// - im_over_budget: a real XFilterEvent() or XCreateIC() went over FORCEIME_IM_BUDGET_US. arg2 is how long it took (ns).
 //
-#define MAX_BYTES_IN 4096
-unsigned char text_string_buffer[MAX_BYTES_IN];
-int text_string_used = 0;
+// Each one is a single nop until someone attaches to it. They need <sys/sdt.h> (systemtap-sdt-dev on Debian).
+// Without it you get a warning, and no probes. Build with -DFORCEIME_NO_PROBES to go without them on purpose.
+// readelf -n ForceIMESupport.so shows stapsdt notes if they're there. (build-and-test.sh checks.)
+//
+#ifndef FORCEIME_NO_PROBES
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FORCEIME_HAVE_SDT
+#endif
+#endif
+#ifndef FORCEIME_HAVE_SDT
+#warning "no <sys/sdt.h>, so no USDT probes. Install systemtap-sdt-dev, or build with -DFORCEIME_NO_PROBES."
+#endif
+#endif
+
+#ifdef FORCEIME_HAVE_SDT
+#define PROBE(name, event_type, value) STAP_PROBE3(forceime, name, QUEUE_DEPTH(), (int)(event_type), (long long)(value))
+#else
+#define PROBE(name, event_type, value) do { } while (0)
+#endif
 
 //
-// This is used as a dummy event to return from XNextEvent() when we need to pass more characters to Unity.
+// These are the functions we hook.
+// The real versions get looked up exactly once, when this library gets loaded.
+// Doing a dlsym() every time XPending() gets called is a great way to waste a frame.
 //
-XEvent last_key_event;
+// Most of them go through the hooks table, so they can be swapped out at load - see _select_hooks().
+// XCreateIC() takes varargs, and XInitThreads() gets called before we're set up, so those two are just plain functions.
+//
+#define FORCEIME_TABLE_HOOKS(X) \
+  X(XCheckIfEvent) \
+  X(XCheckMaskEvent) \
+  X(XCheckTypedEvent) \
+  X(XCheckTypedWindowEvent) \
+  X(XCheckWindowEvent) \
+  X(XCloseDisplay) \
+  X(XCloseIM) \
+  X(XDestroyIC) \
+  X(XEventsQueued) \
+  X(XFilterEvent) \
+  X(XIfEvent) \
+  X(XMaskEvent) \
+  X(XNextEvent) \
+  X(XOpenIM) \
+  X(XPeekEvent) \
+  X(XPeekIfEvent) \
+  X(XPending) \
+  X(XSetICFocus) \
+  X(XUnsetICFocus) \
+  X(XWindowEvent) \
+  X(XmbLookupString) \
+  X(Xutf8LookupString) \
+  X(XwcLookupString)
+
+#define FORCEIME_HOOKS(X) \
+  FORCEIME_TABLE_HOOKS(X) \
+  X(XCreateIC) \
+  X(XInitThreads)
 
 //
-// This is a helper function for dealing with UTF-8 data.
-// It tells us the length of the character at &text_string_buffer[offset].
+// These are functions we call but don't hook.
+// They go through the same table, so a stand-in Xlib can replace them along with everything else.
 //
-static int _buf_char_len(int offset) {
-  if (text_string_buffer[offset] <= 0b01111111) {
-    return 1;
-  } else if (text_string_buffer[offset] <= 0b10111111) {
-    // This is a broken character fragment
-    text_string_buffer[offset] = '?';
-    return 1;
-  } else if (text_string_buffer[offset] <= 0b11011111) {
-    return 2;
-  } else if (text_string_buffer[offset] <= 0b11101111) {
-    return 3;
-  } else if (text_string_buffer[offset] <= 0b11110111) {
-    return 4;
-  } else {
-    // This is a broken character fragment
-    text_string_buffer[offset] = '?';
-    return 1;
+#define FORCEIME_IMPORTS(X) \
+  X(XDisplayOfIM) \
+  X(XPutBackEvent) \
+  X(XRegisterIMInstantiateCallback) \
+  X(XSetICValues) \
+  X(XSetIMValues) \
+  X(XSetLocaleModifiers) \
+  X(XSupportsLocale) \
+  X(XUnregisterIMInstantiateCallback)
+
+struct xlib_functions {
+#define X(name) __typeof__(&name) name;
+  FORCEIME_HOOKS(X)
+  FORCEIME_IMPORTS(X)
+#undef X
+};
+static struct xlib_functions real;
+
+enum hook_id {
+#define X(name) HOOK_##name,
+  FORCEIME_HOOKS(X)
+#undef X
+  HOOK_COUNT
+};
+_Static_assert(HOOK_COUNT <= 32, "disabled_hooks needs more bits");
+
+static const char *const hook_names[HOOK_COUNT] = {
+#define X(name) [HOOK_##name] = #name,
+  FORCEIME_HOOKS(X)
+#undef X
+};
+
+//
+// Configuration.
+//
+// Every setting gets read once, when we're loaded, and after that it's just a variable. Nothing looks at the environment again.
+//
+// Settings come from environment variables, or from a file if FORCEIME_CONFIG is set to its path.
+// The file has one NAME=value per line, using the same names as the environment variables. Lines starting with # get skipped.
+// The environment wins over the file, so you can try out one change without editing it.
+// Setting a variable to nothing still counts - e.g. FORCEIME_RECORD= turns off a recording the file asks for.
+//
+#define MAX_CONFIG_ENTRIES 64
+struct config_entry {
+  char *name;
+  char *value;
+};
+static struct config_entry config_entries[MAX_CONFIG_ENTRIES];
+static int config_entry_count = 0;
+
+static char *_config_trim(char *start, char *end) {
+  while (start < end && (*start == ' ' || *start == '\t')) { start++; }
+  while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) { end--; }
+  *end = '\0';
+  return start;
+}
+
+static void _load_config_file(void) {
+  const char *path = getenv("FORCEIME_CONFIG");
+  if (path == NULL || path[0] == '\0') { return; }
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "ForceIMESupport: could not read FORCEIME_CONFIG \"%s\"\n", path);
+    return;
+  }
+
+  char line[1024];
+  int line_no = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line_no++;
+    char *p = _config_trim(line, line + strlen(line));
+    if (p[0] == '\0' || p[0] == '#') { continue; }
+    char *eq = strchr(p, '=');
+    if (eq == NULL) {
+      fprintf(stderr, "ForceIMESupport: %s:%d isn't NAME=value, skipping it\n", path, line_no);
+      continue;
+    }
+    const char *name = _config_trim(p, eq);
+    const char *value = _config_trim(eq + 1, eq + 1 + strlen(eq + 1));
+
+    // Later lines win.
+    struct config_entry *e = NULL;
+    for (int i = 0; i < config_entry_count; i++) {
+      if (!strcmp(config_entries[i].name, name)) { e = &config_entries[i]; }
+    }
+    if (e == NULL) {
+      if (config_entry_count >= MAX_CONFIG_ENTRIES) {
+        fprintf(stderr, "ForceIMESupport: %s has too many settings, ignoring the rest\n", path);
+        break;
+      }
+      e = &config_entries[config_entry_count++];
+      e->name = strdup(name);
+    } else {
+      free(e->value);
+    }
+    e->value = strdup(value);
+  }
+  fclose(fp);
+}
+
+// Returns the value of a setting, or NULL if it's not set anywhere.
+static const char *_config(const char *name) {
+  const char *value = getenv(name);
+  if (value != NULL) { return value; }
+  for (int i = 0; i < config_entry_count; i++) {
+    if (config_entries[i].name != NULL && config_entries[i].value != NULL && !strcmp(config_entries[i].name, name)) {
+      return config_entries[i].value;
+    }
   }
+  return NULL;
 }
 
 //
-// We wouldn't normally need to intercept Xutf8LookupString(), but Unity is a poorly-written piece of software.
-// So, when the real function inevitably returns multiple UTF-8 characters, we have to do return one at a time.
-// We also need to cooperate with our XNextEvent() shim so that said shim can report more events.
+// How we announce queued characters to the program.
 //
-int Xutf8LookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return)
-{
-  // This is only designed to work for programs which support UTF-8.
-  // If you give us a buffer of less than 4 bytes, we can't do much here!
-  assert(bytes_buffer >= 4);
+// DELIVERY_SINGLE: While there's text queued, XPending() returns True and XEventsQueued() adds 1.
+//   A program which reads the count once per frame will only take one character per frame.
+//   At 20 fps, a 40-character phrase takes 2 seconds to show up. This is what we used to always do.
+//
+// DELIVERY_BURST: We report one pending event for every character still queued.
+//   A program which drains "however many events are queued" will take the whole commit in one frame.
+//
+// DELIVERY_PACED: We work out the program's frame rate (see _note_poll()), and report just enough characters each frame
+//   for the queue to drain within FORCEIME_TARGET_LATENCY_MS. (Default: 100)
+//   A slow program gets more per frame, a fast one gets fewer, and a big commit gets spread out rather than landing all at once.
+//
+// Set FORCEIME_DELIVERY to "single", "burst" or "paced" to pick one. The default is "single".
+//
+enum delivery_mode {
+  DELIVERY_SINGLE,
+  DELIVERY_BURST,
+  DELIVERY_PACED,
+};
+static enum delivery_mode delivery_mode = DELIVERY_SINGLE;
+static uint64_t target_latency_ns = 100000000;
+
+//
+// While we're feeding characters through XNextEvent(), real events still need to get a look in.
+//
+// Some real events jump the queue - see priority_event_types below.
+// Everything else waits, but only for FORCEIME_MAX_REAL_LAG synthetic events in a row. (Default: 16)
+// After that, the next real event gets delivered before we continue. 0 means real events never wait.
+//
+static int max_real_lag = 16;
+
+//
+// Programs which use Xlib from more than one thread need to call XInitThreads() first.
+// We watch for that (see XInitThreads() below), and guard our queues if it happens.
+// FORCEIME_THREADSAFE=1 turns this on regardless.
+//
+// libX11 1.8 and later call XInitThreads() themselves, so expect this to be on with any recent Xlib.
+//
+static int threaded = 0;
+
+//
+// How many ICs we keep around for reuse. See XCreateIC() below.
+//
+#define MAX_CACHED_ICS 16
+static int ic_cache_size = 8;
+
+//
+// Whether XOpenIM() waits for the IM server. See XOpenIM() below.
+//
+static int async_im_mode = 0;
+
+//
+// The input style XCreateIC() asks for. See XCreateIC() below.
+// FORCEIME_INPUT_STYLE=nothing (the default) forces XIMPreeditNothing | XIMStatusNothing.
+// FORCEIME_INPUT_STYLE=program uses whatever the program asked for, which is only any use if it asked for something sensible.
+//
+static XIMStyle forced_input_style = XIMPreeditNothing | XIMStatusNothing;
+
+//
+// This is how many bytes we ask the real *LookupString() for to begin with. (FORCEIME_LOOKUP_BYTES, default: 4096)
+// If the IM has more than that, it tells us how much it wants, and we try again with a bigger buffer.
+//
+static int lookup_bytes_in = 4096;
+
+//
+// FORCEIME_XLIB: where the real functions come from. See _resolve_real_functions().
+//
+static const char *xlib_path = NULL;
 
-  static int (*real)(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) = NULL;
-  if (real == NULL) { real = dlsym(RTLD_NEXT, "Xutf8LookupString"); }
-  if (real == NULL) { abort(); };
+//
+// Hooks listed in FORCEIME_DISABLE (separated by commas or spaces) get left alone - the program gets the real function.
+// This is for measuring what each hook costs, so don't expect text input to work with the important ones turned off!
+// XInitThreads() is how we find out we need locks, so that one can't be turned off.
+//
+static uint32_t disabled_hooks = 0;
+#define HOOK_ENABLED(name) ((disabled_hooks & (1u << HOOK_##name)) == 0)
 
-  int added = 0;
-  if (text_string_used == 0) {
-    added = real(ic, event, (char *)&text_string_buffer[text_string_used], MAX_BYTES_IN - text_string_used, keysym_return, status_return);
+static void _read_disabled_hooks(const char *list) {
+  char name[64];
+  while (*list != '\0') {
+    size_t len = strcspn(list, ", \t");
+    if (len > 0 && len < sizeof(name)) {
+      memcpy(name, list, len);
+      name[len] = '\0';
+      int found = -1;
+      for (int i = 0; i < HOOK_COUNT; i++) {
+        if (!strcmp(hook_names[i], name)) { found = i; }
+      }
+      if (found < 0) {
+        fprintf(stderr, "ForceIMESupport: FORCEIME_DISABLE has \"%s\", which isn't something we hook\n", name);
+      } else if (found == HOOK_XInitThreads) {
+        fprintf(stderr, "ForceIMESupport: XInitThreads can't be disabled, leaving it on\n");
+      } else {
+        disabled_hooks |= 1u << found;
+      }
+    }
+    list += len;
+    if (*list != '\0') { list++; }
   }
-  //fprintf(stderr, "shimmed Xutf8LookupString! %d bytes, got %d\n", text_string_used, added); fflush(stderr);
+}
+
+//
+// This runs before anything else of ours does, whoever gets here first - our constructor, XInitThreads(), or ForceIMEAudit.so.
+//
+static pthread_once_t settings_once = PTHREAD_ONCE_INIT;
+
+static void _read_settings(void) {
+  _load_config_file();
 
-  int new_used = text_string_used + added;
-  if (new_used >= MAX_BYTES_IN) {
-    // TODO: Handle overflow properly! (dropping for now) --GM
-    fprintf(stderr, "FIXME: Xutf8LookupString overflowed! %d -> %d\n", text_string_used, new_used);
+  const char *mode = _config("FORCEIME_DELIVERY");
+  if (mode == NULL || !strcmp(mode, "single")) {
+    delivery_mode = DELIVERY_SINGLE;
+  } else if (!strcmp(mode, "burst")) {
+    delivery_mode = DELIVERY_BURST;
+  } else if (!strcmp(mode, "paced")) {
+    delivery_mode = DELIVERY_PACED;
   } else {
-    text_string_used = new_used;
+    fprintf(stderr, "ForceIMESupport: unknown FORCEIME_DELIVERY \"%s\", using \"single\"\n", mode);
   }
 
-  int shimmed_result = 0;
-  if (text_string_used >= 1) {
-    int bytes_to_grab = _buf_char_len(0);
+  const char *target = _config("FORCEIME_TARGET_LATENCY_MS");
+  if (target != NULL && atoi(target) > 0) {
+    target_latency_ns = (uint64_t)atoi(target) * 1000000;
+  }
 
-    //fprintf(stderr, "Xutf8LookupString grabbing %d bytes of %d\n", bytes_to_grab, text_string_used); fflush(stderr);
+  const char *lag = _config("FORCEIME_MAX_REAL_LAG");
+  if (lag != NULL) {
+    max_real_lag = atoi(lag);
+    if (max_real_lag < 0) { max_real_lag = 0; }
+  }
 
-    // SANITY CHECK: Make sure this doesn't actually overflow!
-    if (bytes_to_grab >= text_string_used) {
-      bytes_to_grab = text_string_used;
-    }
+  const char *ic_cache_env = _config("FORCEIME_IC_CACHE");
+  if (ic_cache_env != NULL) {
+    ic_cache_size = atoi(ic_cache_env);
+    if (ic_cache_size < 0) { ic_cache_size = 0; }
+    if (ic_cache_size > MAX_CACHED_ICS) { ic_cache_size = MAX_CACHED_ICS; }
+  }
 
-    // Copy this across
-    assert(bytes_buffer >= bytes_to_grab);
-    shimmed_result = bytes_to_grab;
-    memmove(buffer_return, text_string_buffer, bytes_to_grab);
+  const char *async_im = _config("FORCEIME_ASYNC_IM");
+  if (async_im != NULL && atoi(async_im) != 0) {
+    async_im_mode = 1;
+  }
 
-    // Remove from the original buffer
-    text_string_used -= bytes_to_grab;
-    if (text_string_used >= 0) {
-      memmove(&text_string_buffer[0], &text_string_buffer[bytes_to_grab], text_string_used);
-    }
+  const char *threadsafe = _config("FORCEIME_THREADSAFE");
+  if (threadsafe != NULL && atoi(threadsafe) != 0) {
+    threaded = 1;
+  }
 
-    // Clear that part of the buffer
-    memset(&text_string_buffer[text_string_used], 0, bytes_to_grab);
+  const char *style = _config("FORCEIME_INPUT_STYLE");
+  if (style == NULL || !strcmp(style, "nothing")) {
+    forced_input_style = XIMPreeditNothing | XIMStatusNothing;
+  } else if (!strcmp(style, "program")) {
+    forced_input_style = 0;
+  } else {
+    fprintf(stderr, "ForceIMESupport: unknown FORCEIME_INPUT_STYLE \"%s\", using \"nothing\"\n", style);
   }
 
-  return shimmed_result;
+  const char *lookup_bytes = _config("FORCEIME_LOOKUP_BYTES");
+  if (lookup_bytes != NULL && atoi(lookup_bytes) > 0) {
+    lookup_bytes_in = atoi(lookup_bytes);
+  }
+
+  xlib_path = _config("FORCEIME_XLIB");
+
+  const char *disable = _config("FORCEIME_DISABLE");
+  if (disable != NULL) {
+    _read_disabled_hooks(disable);
+  }
 }
 
 //
-// XOpenIM needs some things done to the environment before it is called.
+// If any of these are missing, we'd rather find out now than in the middle of a frame.
 //
-XIM XOpenIM(Display *display, XrmDatabase db, char *res_name, char *res_class) {
-  static XIM (*real)(Display *display, XrmDatabase db, char *res_name, char *res_class) = NULL;
-  if (real == NULL) { real = dlsym(RTLD_NEXT, "XOpenIM"); }
-  if (real == NULL) { abort(); };
+// Normally the real functions are whatever comes after us in the search order.
+// Set FORCEIME_XLIB to the path of a library to take them from there instead - e.g. a fake Xlib which scripts its results,
+// for testing or benchmarking the hooks without an X server. (ForceIMEStubXlib.so is one. See ForceIMEBench.) If it's set but empty, we look in the global scope instead,
+// which lets a program that dlopen()s us provide the real functions itself.
+//
+// If there's no Xlib there at all, that's not our problem yet. We get preloaded into every shell and helper the game starts,
+// and some programs only dlopen() libX11 later. So we leave everything unresolved, and try again when someone asks for
+// one of our hooks (see forceime_hook_for()). Only an Xlib with functions missing is worth stopping for.
+// Returns False if there was no Xlib.
+//
+static Bool _resolve_real_functions(void) {
+  pthread_once(&settings_once, _read_settings);
 
-  // For the IME to work, we need to set a valid locale and valid locale modifiers.
-  if (setlocale(LC_ALL, "") != NULL) {
-    if (XSupportsLocale()) {
-      (void)XSetLocaleModifiers("");
+  void *xlib = RTLD_NEXT;
+  if (xlib_path != NULL) {
+    xlib = dlopen(xlib_path[0] != '\0' ? xlib_path : NULL, RTLD_NOW | RTLD_LOCAL);
+    if (xlib == NULL) {
+      fprintf(stderr, "ForceIMESupport: could not open FORCEIME_XLIB \"%s\": %s\n", xlib_path, dlerror());
+      abort();
     }
   }
 
-  XIM result = real(display, db, res_name, res_class);
-  fprintf(stderr, "shimmed XOpenIM!\n"); fflush(stderr);
-  return result;
+  struct xlib_functions found;
+  int missing = 0;
+  int total = 0;
+#define X(name) \
+  found.name = dlsym(xlib, #name); \
+  total++; \
+  if (found.name == NULL) { missing++; }
+  FORCEIME_HOOKS(X)
+  FORCEIME_IMPORTS(X)
+#undef X
+  if (missing == total && (xlib_path == NULL || xlib_path[0] == '\0')) { return False; }
+
+  if (missing > 0) {
+#define X(name) if (found.name == NULL) { fprintf(stderr, "ForceIMESupport: could not find real %s()!\n", #name); }
+    FORCEIME_HOOKS(X)
+    FORCEIME_IMPORTS(X)
+#undef X
+    abort();
+  }
+  real = found;
+  return True;
 }
 
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
 //
-// XCreateIC is another place where we need to ensure certain things are set for an IME to work.
+// Statistics.
 //
-// XCreateIC takes a variable number of arguments.
-// Passing this along correctly is currently more trouble than it's worth.
+// We keep HDR-style histograms of:
+// - how long each character sits in our queue, from when the real Xutf8LookupString() gives it to us
+//   to when we hand it to the program (nanoseconds),
+// - how many characters were already queued for a Display when a new commit turned up,
+// - how long the program's frames take (see _note_poll()),
+// - and, with DELIVERY_PACED, how many characters we offered per frame.
 //
-// So instead, we're going to read what we can from here, and send only what we want...
+// Each histogram has 16 linear sub-buckets per power of 2, so any value is recorded to within about 6%.
+// Recording is a couple of relaxed atomic increments. Nothing ever locks.
+// Without FORCEIME_STATS_FILE, STATS_RECORD() doesn't record anything, or even work out what it would have recorded.
 //
-// XNInputStyle:
-// Using XIMPreeditNothing | XIMStatusNothing.
-// Not to be confused with XIMPreeditNone | XIMStatusNone, which prevents the IME from working.
-// UPDATE: I accidentally said that Unity 2019 uses None. It uses Nothing instead, which is what we currently want.
+// Set FORCEIME_STATS_FILE to a path to get these written there at exit.
+// Sending the process SIGUSR2 writes them out too, the next time the program polls for events.
+// Unless the program had its own SIGUSR2 handler (or was ignoring it) before we loaded. Then we leave it alone.
 //
-// XNClientWindow:
-// A compulsory argument. We need to grab this from the program.
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+};
+static struct histogram char_latency_hist;
+static struct histogram queue_depth_hist;
+static struct histogram frame_interval_hist;
+static struct histogram paced_burst_hist;
+
 //
-// XNFocusWindow:
-// If the program uses this argument explicitly, we need to grab it. Probably.
+// What we know about the program's frames. See _note_poll().
 //
-XIC XCreateIC(XIM im, ...) {
-  static XIC (*real)(XIM im, ...) = NULL;
-  if (real == NULL) { real = dlsym(RTLD_NEXT, "XCreateIC"); }
-  if (real == NULL) { abort(); };
+struct frame_pacing {
+  uint64_t last_poll_ns;
+  uint64_t frame_start_ns;
+  uint64_t frame_ns;     // Moving average, or 0 until we've seen a frame
+  int burst;             // How many characters this frame gets, or -1 if we haven't worked that out yet
+  int delivered;         // How many it's had
+  int last_burst;        // The last burst we worked out, for the stats
+};
+static struct frame_pacing pacing = { 0, 0, 0, -1, 0, 0 };
 
-  fprintf(stderr, "shimming XCreateIC and I want to cry\n"); fflush(stderr);
+static const char *stats_file = NULL;
+static volatile sig_atomic_t stats_dump_requested = 0;
 
-  Window client_window = 0;
-  Window focus_window = 0;
-  va_list ap;
-  va_start(ap, im);
-  for (;;) {
-    const char *k = va_arg(ap, const char *);
-    if (k == NULL) { break; } // End of list
+static int _hist_bucket(uint64_t v) {
+  if (v < HIST_SUB_BUCKETS) { return (int)v; }
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & (HIST_SUB_BUCKETS - 1));
+}
 
-    if (!strcmp(k, XNInputStyle)) {
-      int v = va_arg(ap, int);
-      fprintf(stderr, "shimmed arg \"%s\": %d\n", k, v); fflush(stderr);
-    } else if (!strcmp(k, XNClientWindow)) {
-      Window v = va_arg(ap, Window);
-      client_window = v;
-      fprintf(stderr, "captured arg \"%s\": %lu\n", k, v); fflush(stderr);
-    } else if (!strcmp(k, XNFocusWindow)) {
-      Window v = va_arg(ap, Window);
-      focus_window = v;
-      fprintf(stderr, "captured arg \"%s\": %lu\n", k, v); fflush(stderr);
-    } else if (!strcmp(k, XNPreeditAttributes)) {
-      // TODO: If someone actually runs this in a program which supports preedit, we will probably want to at least not break things. --GM
-      XVaNestedList v = va_arg(ap, XVaNestedList);
-      fprintf(stderr, "misc arg \"%s\": %p\n", k, v); fflush(stderr);
-    } else {
-      void *v = va_arg(ap, void *);
-      fprintf(stderr, "misc arg \"%s\": %p\n", k, v); fflush(stderr);
+// The smallest value which lands in a given bucket.
+static uint64_t _hist_bucket_floor(int bucket) {
+  if (bucket < HIST_SUB_BUCKETS) { return (uint64_t)bucket; }
+  int shift = (bucket >> HIST_SUB_BITS) - 1;
+  return ((uint64_t)HIST_SUB_BUCKETS | (uint64_t)(bucket & (HIST_SUB_BUCKETS - 1))) << shift;
+}
+
+static void _hist_record(struct histogram *h, uint64_t v) {
+  __atomic_add_fetch(&h->buckets[_hist_bucket(v)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum, v, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, True, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+#define STATS_RECORD(h, v) \
+  do { \
+    if (__builtin_expect(stats_file != NULL, 0)) { _hist_record((h), (v)); } \
+  } while (0)
+
+static uint64_t _hist_percentile(const struct histogram *h, double pct) {
+  uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  if (count == 0) { return 0; }
+  uint64_t target = (uint64_t)(count * pct / 100.0);
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    if (seen > target) { return _hist_bucket_floor(i); }
+  }
+  return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+static void _hist_write(FILE *fp, const char *name, const char *unit, const struct histogram *h) {
+  uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  fprintf(fp, "%s: count=%llu mean=%llu%s p50=%llu%s p90=%llu%s p99=%llu%s p99.9=%llu%s max=%llu%s\n",
+    name, (unsigned long long)count,
+    (unsigned long long)(count > 0 ? __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / count : 0), unit,
+    (unsigned long long)_hist_percentile(h, 50.0), unit,
+    (unsigned long long)_hist_percentile(h, 90.0), unit,
+    (unsigned long long)_hist_percentile(h, 99.0), unit,
+    (unsigned long long)_hist_percentile(h, 99.9), unit,
+    (unsigned long long)__atomic_load_n(&h->max, __ATOMIC_RELAXED), unit);
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    uint64_t n = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    if (n != 0) {
+      fprintf(fp, "  %s >= %llu%s: %llu\n", name, (unsigned long long)_hist_bucket_floor(i), unit, (unsigned long long)n);
     }
   }
-  va_end(ap);
+}
 
-  XIC result = real(im,
-    XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
-    XNClientWindow, client_window,
-    XNFocusWindow, focus_window,
-    NULL);
-  fprintf(stderr, "shimmed XCreateIC!\n"); fflush(stderr);
-  return result;
+static void _write_im_stats(FILE *fp);
+#ifdef FORCEIME_PROFILE
+static void _write_profile(FILE *fp);
+#endif
+
+static void _write_stats(void) {
+  if (stats_file == NULL) { return; }
+  FILE *fp = fopen(stats_file, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "ForceIMESupport: could not write stats to \"%s\"\n", stats_file);
+    return;
+  }
+  _hist_write(fp, "char_latency", "ns", &char_latency_hist);
+  _hist_write(fp, "queue_depth", "", &queue_depth_hist);
+  _hist_write(fp, "frame_interval", "ns", &frame_interval_hist);
+  _hist_write(fp, "paced_burst", "", &paced_burst_hist);
+  _write_im_stats(fp);
+#ifdef FORCEIME_PROFILE
+  _write_profile(fp);
+#endif
+  uint64_t frame_ns = __atomic_load_n(&pacing.frame_ns, __ATOMIC_RELAXED);
+  fprintf(fp, "pacing: fps=%.1f burst=%d target_latency=%lluns\n",
+    (frame_ns > 0 ? 1e9 / frame_ns : 0.0), __atomic_load_n(&pacing.last_burst, __ATOMIC_RELAXED), (unsigned long long)target_latency_ns);
+  fclose(fp);
+}
+
+static void _request_stats_dump(int sig) {
+  (void)sig;
+  stats_dump_requested = 1;
+}
+
+// This gets called from the hooks that programs poll. Writing a file isn't something we can do from a signal handler.
+static inline void _check_stats_dump(void) {
+  if (__builtin_expect(stats_dump_requested, 0)) {
+    stats_dump_requested = 0;
+    _write_stats();
+  }
+}
+
+static void _setup_stats(void) {
+  stats_file = _config("FORCEIME_STATS_FILE");
+  if (stats_file != NULL && stats_file[0] != '\0') {
+    atexit(_write_stats);
+    // SIGUSR2 might be the program's already. If so, it keeps it, and the stats only get written at exit.
+    struct sigaction old;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _request_stats_dump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, NULL, &old) != 0 || old.sa_handler != SIG_DFL) {
+      fprintf(stderr, "ForceIMESupport: SIGUSR2 is already taken, so it won't write out stats (they still get written at exit)\n");
+    } else if (sigaction(SIGUSR2, &sa, NULL) != 0) {
+      fprintf(stderr, "ForceIMESupport: could not set up SIGUSR2 to write out stats (they still get written at exit)\n");
+    }
+  } else {
+    stats_file = NULL;
+  }
+}
+
+static inline uint64_t _now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
 
 //
-// We may need to force our fake events through the system.
+// Live statistics.
 //
-Bool XFilterEvent(XEvent *event, Window w) {
-  int (*real)(XEvent *event, Window w) = NULL;
-  if (real == NULL) { real = dlsym(RTLD_NEXT, "XFilterEvent"); }
-  if (real == NULL) { abort(); };
+// These are counters for watching from outside while the program runs - see ForceIMEStats.h, and ForceIMEStat.
+// They only get counted with FORCEIME_LIVE_STATS=1, and then they live in /dev/shm/forceime-<pid> where anyone can read them.
+// Otherwise live_stats is NULL, and counting is one branch that never gets taken.
+// Hook calls don't even cost that: _select_hooks() only puts the counting ones in when they're wanted.
+//
+_Static_assert(HOOK_COUNT <= FORCEIME_STATS_MAX_HOOKS, "forceime_stats_page needs room for more hooks");
 
-  // Do not filter the fake events.
-  if (text_string_used > 0 && event->type == KeyPress && event->xkey.keycode == None) {
-    return False;
-  }
+static struct forceime_stats_page *live_stats = NULL;
+static char live_stats_name[32];
+
+#define LIVE_ADD(field, n) \
+  do { \
+    if (__builtin_expect(live_stats != NULL, 0)) { __atomic_add_fetch(&live_stats->field, (n), __ATOMIC_RELAXED); } \
+  } while (0)
+#define LIVE_COUNT(field) LIVE_ADD(field, 1)
+#define COUNT_CALL(name) LIVE_COUNT(hook_calls[HOOK_##name])
 
-  return real(event, w);
+// How many characters are queued, over every Display. Every probe hands this out, so it gets kept whenever they're compiled in,
+// whether or not there are live stats. (Those keep their own copy, with the maximum, in the page.)
+#ifdef FORCEIME_HAVE_SDT
+static int64_t queue_depth = 0;
+#define QUEUE_DEPTH() __atomic_load_n(&queue_depth, __ATOMIC_RELAXED)
+#endif
+
+static void _queue_depth_change(int64_t change) {
+#ifdef FORCEIME_HAVE_SDT
+  __atomic_add_fetch(&queue_depth, change, __ATOMIC_RELAXED);
+#endif
+  if (__builtin_expect(live_stats == NULL, 1)) { return; }
+  int64_t depth = __atomic_add_fetch(&live_stats->queue_depth, change, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&live_stats->max_queue_depth, __ATOMIC_RELAXED);
+  while (depth > 0 && (uint64_t)depth > max
+    && !__atomic_compare_exchange_n(&live_stats->max_queue_depth, &max, (uint64_t)depth, True, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
 }
 
-int XPending(Display *display) {
-  int (*real)(Display *display) = NULL;
-  if (real == NULL) { real = dlsym(RTLD_NEXT, "XPending"); }
-  if (real == NULL) { abort(); };
+static void _remove_live_stats(void) {
+  // A forked child gets this too, but the page isn't its to remove.
+  if (live_stats->pid == (uint64_t)getpid()) {
+    shm_unlink(live_stats_name);
+  }
+}
 
-  // Announce our fake events.
-  if (text_string_used > 0) {
-    return True;
+static void _setup_live_stats(void) {
+  const char *live = _config("FORCEIME_LIVE_STATS");
+  if (live == NULL || atoi(live) == 0) { return; }
+
+  snprintf(live_stats_name, sizeof(live_stats_name), FORCEIME_STATS_NAME_FORMAT, (int)getpid());
+  int fd = shm_open(live_stats_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  void *map = MAP_FAILED;
+  if (fd >= 0 && ftruncate(fd, sizeof(struct forceime_stats_page)) == 0) {
+    map = mmap(NULL, sizeof(struct forceime_stats_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (fd >= 0) { close(fd); }
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "ForceIMESupport: could not create live stats page \"/dev/shm%s\"\n", live_stats_name);
+    if (fd >= 0) { shm_unlink(live_stats_name); }
+    return;
   }
 
-  return real(display);
+  struct forceime_stats_page *page = map;
+  page->version = FORCEIME_STATS_VERSION;
+  page->size = sizeof(struct forceime_stats_page);
+  page->pid = (uint64_t)getpid();
+  page->start_ns = _now_ns();
+  page->hook_count = HOOK_COUNT;
+  for (int i = 0; i < HOOK_COUNT; i++) {
+    strncpy(page->hook_names[i], hook_names[i], FORCEIME_STATS_HOOK_NAME_BYTES - 1);
+  }
+  live_stats = page;
+  atexit(_remove_live_stats);
+  // The magic goes in last, so a reader never sees a page that's only half filled in.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(page->magic, FORCEIME_STATS_MAGIC, sizeof(page->magic));
 }
 
-int XEventsQueued(Display *display, int mode) {
-  int (*real)(Display *display, int mode) = NULL;
-  if (real == NULL) { real = dlsym(RTLD_NEXT, "XEventsQueued"); }
-  if (real == NULL) { abort(); };
+//
+// Profiling.
+//
+// Build with -DFORCEIME_PROFILE to find out what the shim itself costs. (build-and-test.sh puts one in profile/.)
+// Preload that one instead, or hand it to ForceIMEReplay to profile a recording.
+// Each hook gets timed, minus whatever time it spent waiting on the real Xlib functions, so what's left is ours.
+// We add that up over each of the program's frames (see _note_poll()), so you can see what fraction of a frame we take.
+//
+// At exit, we print a summary to stderr: percentiles per hook, and per frame. The full histograms go in FORCEIME_STATS_FILE.
+//
+// The clock is clock_gettime(), which comes from the vDSO, so it's a couple of dozen nanoseconds and no system call.
+// It doesn't time varargs functions (XCreateIC(), XSetICValues(), XSetIMValues()) separately, so those count against their hook.
+// They only get called when setting up an IC, not every frame.
+//
+// None of this exists in a normal build.
+//
+#ifdef FORCEIME_PROFILE
+static struct histogram hook_cost_hist[HOOK_COUNT];
+static struct histogram frame_cost_hist;   // How long we took, per frame (nanoseconds)
+static struct histogram frame_share_hist;  // How much of the frame that was (parts per million)
+static uint64_t frame_cost_ns = 0;         // What we've taken so far this frame
 
-  // Announce our fake events.
-  int result = real(display, mode);
-  if (text_string_used > 0) {
-    return result + 1;
+static __thread uint64_t profile_real_ns = 0;  // How long the current hook has spent in real functions
+static __thread int profile_depth = 0;
+
+struct hook_profile {
+  int hook;
+  uint64_t start_ns;
+  uint64_t outer_real_ns;
+};
+
+static inline struct hook_profile _profile_enter(int hook) {
+  struct hook_profile p = { hook, _now_ns(), profile_real_ns };
+  profile_real_ns = 0;
+  profile_depth++;
+  return p;
+}
+
+static inline void _profile_exit(struct hook_profile *p) {
+  uint64_t elapsed = _now_ns() - p->start_ns;
+  uint64_t own_ns = (elapsed > profile_real_ns ? elapsed - profile_real_ns : 0);
+  _hist_record(&hook_cost_hist[p->hook], own_ns);
+  profile_real_ns = p->outer_real_ns;
+  // A hook called from inside another one is part of that one's time already.
+  if (--profile_depth == 0) {
+    __atomic_add_fetch(&frame_cost_ns, own_ns, __ATOMIC_RELAXED);
   }
-  return result;
+}
+
+#define HOOK_ENTER(name) \
+  struct hook_profile hook_profile __attribute__((cleanup(_profile_exit))) = _profile_enter(HOOK_##name)
+
+// Called by _note_poll() when a frame ends. frame_ns is 0 if we don't know how long it was.
+static void _profile_end_frame(uint64_t frame_ns) {
+  uint64_t cost_ns = __atomic_exchange_n(&frame_cost_ns, 0, __ATOMIC_RELAXED);
+  if (frame_ns == 0) { return; }
+  _hist_record(&frame_cost_hist, cost_ns);
+  _hist_record(&frame_share_hist, cost_ns * 1000000 / frame_ns);
 }
 
 //
-// Any event which comes out of XNextEvent() *MUST* be fed through XFilterEvent()!
-// So, that's what we do...
-// ... unless we need to tell the program that there's still more text to accept.
+// The real functions get swapped out for these, which keep track of how long they take. See _select_hooks().
 //
-int XNextEvent(Display *display, XEvent *event_return) {
-  static int last_result = 0; // FIXME: The return value of this doesn't seem to be defined...? Grab it from a valid call to XNextEvent anyway. --GM
+#define FORCEIME_PROFILED_REALS(X) \
+  X(Bool, XCheckIfEvent, (Display *d, XEvent *e, Bool (*pred)(Display *, XEvent *, XPointer), XPointer arg), (d, e, pred, arg)) \
+  X(Bool, XCheckMaskEvent, (Display *d, long mask, XEvent *e), (d, mask, e)) \
+  X(Bool, XCheckTypedEvent, (Display *d, int type, XEvent *e), (d, type, e)) \
+  X(Bool, XCheckTypedWindowEvent, (Display *d, Window w, int type, XEvent *e), (d, w, type, e)) \
+  X(Bool, XCheckWindowEvent, (Display *d, Window w, long mask, XEvent *e), (d, w, mask, e)) \
+  X(int, XCloseDisplay, (Display *d), (d)) \
+  X(Status, XCloseIM, (XIM im), (im)) \
+  X(Display *, XDisplayOfIM, (XIM im), (im)) \
+  X(int, XEventsQueued, (Display *d, int mode), (d, mode)) \
+  X(Bool, XFilterEvent, (XEvent *e, Window w), (e, w)) \
+  X(Status, XInitThreads, (void), ()) \
+  X(int, XIfEvent, (Display *d, XEvent *e, Bool (*pred)(Display *, XEvent *, XPointer), XPointer arg), (d, e, pred, arg)) \
+  X(int, XMaskEvent, (Display *d, long mask, XEvent *e), (d, mask, e)) \
+  X(int, XNextEvent, (Display *d, XEvent *e), (d, e)) \
+  X(XIM, XOpenIM, (Display *d, XrmDatabase db, char *res_name, char *res_class), (d, db, res_name, res_class)) \
+  X(int, XPeekEvent, (Display *d, XEvent *e), (d, e)) \
+  X(int, XPeekIfEvent, (Display *d, XEvent *e, Bool (*pred)(Display *, XEvent *, XPointer), XPointer arg), (d, e, pred, arg)) \
+  X(int, XPending, (Display *d), (d)) \
+  X(int, XPutBackEvent, (Display *d, XEvent *e), (d, e)) \
+  X(Bool, XRegisterIMInstantiateCallback, (Display *d, XrmDatabase db, char *res_name, char *res_class, XIDProc cb, XPointer data), (d, db, res_name, res_class, cb, data)) \
+  X(char *, XSetLocaleModifiers, (const char *modifiers), (modifiers)) \
+  X(Bool, XSupportsLocale, (void), ()) \
+  X(Bool, XUnregisterIMInstantiateCallback, (Display *d, XrmDatabase db, char *res_name, char *res_class, XIDProc cb, XPointer data), (d, db, res_name, res_class, cb, data)) \
+  X(int, XWindowEvent, (Display *d, Window w, long mask, XEvent *e), (d, w, mask, e)) \
+  X(int, XmbLookupString, (XIC ic, XKeyPressedEvent *e, char *buf, int len, KeySym *keysym, Status *status), (ic, e, buf, len, keysym, status)) \
+  X(int, Xutf8LookupString, (XIC ic, XKeyPressedEvent *e, char *buf, int len, KeySym *keysym, Status *status), (ic, e, buf, len, keysym, status)) \
+  X(int, XwcLookupString, (XIC ic, XKeyPressedEvent *e, wchar_t *buf, int len, KeySym *keysym, Status *status), (ic, e, buf, len, keysym, status))
 
-  static int (*real)(Display *display, XEvent *event_return) = NULL;
-  if (real == NULL) { real = dlsym(RTLD_NEXT, "XNextEvent"); }
-  if (real == NULL) { abort(); };
+#define FORCEIME_PROFILED_VOID_REALS(X) \
+  X(XDestroyIC, (XIC ic), (ic)) \
+  X(XSetICFocus, (XIC ic), (ic)) \
+  X(XUnsetICFocus, (XIC ic), (ic))
 
-  // If we have more characters to pass through,
-  // synthesise some KeyPress events in order to pass them through.
-  if (text_string_used > 0) {
-    *event_return = last_key_event;
-    event_return->xkey.type = KeyPress;
-    event_return->xkey.keycode = None;
-    return last_result;
+static struct xlib_functions unprofiled_real;
+
+#define X(type, name, params, args) \
+  static type _profiled_real_##name params { \
+    uint64_t t0 = _now_ns(); \
+    type result = unprofiled_real.name args; \
+    profile_real_ns += _now_ns() - t0; \
+    return result; \
   }
+FORCEIME_PROFILED_REALS(X)
+#undef X
 
-  int result = real(display, event_return);
-  if (event_return->type == KeyPress) {
-    last_key_event = *event_return;
+#define X(name, params, args) \
+  static void _profiled_real_##name params { \
+    uint64_t t0 = _now_ns(); \
+    unprofiled_real.name args; \
+    profile_real_ns += _now_ns() - t0; \
   }
+FORCEIME_PROFILED_VOID_REALS(X)
+#undef X
 
-  return result;
+static void _profile_real_functions(void) {
+  unprofiled_real = real;
+#define X(type, name, params, args) real.name = _profiled_real_##name;
+  FORCEIME_PROFILED_REALS(X)
+#undef X
+#define X(name, params, args) real.name = _profiled_real_##name;
+  FORCEIME_PROFILED_VOID_REALS(X)
+#undef X
+}
+
+static void _write_profile(FILE *fp) {
+  for (int i = 0; i < HOOK_COUNT; i++) {
+    if (hook_cost_hist[i].count == 0) { continue; }
+    char name[64];
+    snprintf(name, sizeof(name), "hook_cost.%s", hook_names[i]);
+    _hist_write(fp, name, "ns", &hook_cost_hist[i]);
+  }
+  _hist_write(fp, "frame_cost", "ns", &frame_cost_hist);
+  _hist_write(fp, "frame_share", "ppm", &frame_share_hist);
+}
+
+static void _report_profile(void) {
+  fprintf(stderr, "ForceIMESupport profile (time in the shim, not counting Xlib):\n");
+  for (int i = 0; i < HOOK_COUNT; i++) {
+    const struct histogram *h = &hook_cost_hist[i];
+    if (h->count == 0) { continue; }
+    fprintf(stderr, "  %-24s calls=%llu p50=%lluns p90=%lluns p99=%lluns max=%lluns total=%.3fms\n",
+      hook_names[i], (unsigned long long)h->count,
+      (unsigned long long)_hist_percentile(h, 50.0), (unsigned long long)_hist_percentile(h, 90.0),
+      (unsigned long long)_hist_percentile(h, 99.0), (unsigned long long)h->max, h->sum / 1e6);
+  }
+  fprintf(stderr, "  per frame: frames=%llu p50=%lluns p99=%lluns max=%lluns, p50=%.3f%% p99=%.3f%% max=%.3f%% of the frame\n",
+    (unsigned long long)frame_cost_hist.count,
+    (unsigned long long)_hist_percentile(&frame_cost_hist, 50.0), (unsigned long long)_hist_percentile(&frame_cost_hist, 99.0),
+    (unsigned long long)frame_cost_hist.max,
+    _hist_percentile(&frame_share_hist, 50.0) / 1e4, _hist_percentile(&frame_share_hist, 99.0) / 1e4, frame_share_hist.max / 1e4);
 }
+#else
+#define HOOK_ENTER(name)
+#endif
 
 //
-// UnityPlayer.so grabs its X11 symbols via dlsym().
-// This causes it to bypass the functions provided in this library.
+// Logging.
 //
-// If you do a 1-byte hex edit so that the only instance of "dlsym" in the file becomes "Dlsym",
-// then it will end up using the functions we want it to.
+// Writing to stderr from a hook is a bad idea - if stderr is a pipe or journald, the program's main thread stalls on it.
+// So the hooks just drop a fixed-size record into a ring, and a background thread formats and writes them out.
+// Whatever's left at exit gets written out then.
 //
-void *Dlsym(void *restrict handle, const char *restrict symbol)
-{
-  //fprintf(stderr, "Dlsym -> dlsym shim: %p \"%s\"\n", handle, symbol); fflush(stderr);
+// Set FORCEIME_LOG to "off", "error", "warn", "info" or "debug". The default is "info".
+// Anything below that level costs one branch.
+//
+// Each record carries a format string (which MUST be a string literal), up to 31 bytes of string, and two integers.
+// The format gets those in that order: (str, a, b). Use "%.0s" if you want to skip the string.
+//
+// The ring is a bounded multi-producer queue (Dmitry Vyukov's design): each cell has a sequence number,
+// producers claim a position with a compare-and-swap, and nobody ever waits. If it's full, the record gets dropped and counted.
+//
+enum log_level {
+  LOG_OFF,
+  LOG_ERROR,
+  LOG_WARN,
+  LOG_INFO,
+  LOG_DEBUG,
+};
+static enum log_level log_level = LOG_INFO;
+
+#define LOG_RING_SIZE 1024 // Must be a power of 2!
+#define LOG_STR_BYTES 32
+struct log_record {
+  size_t seq;
+  uint64_t ns;
+  const char *fmt;
+  char str[LOG_STR_BYTES];
+  long long a;
+  long long b;
+};
+static struct log_record log_ring[LOG_RING_SIZE];
+static size_t log_enqueue_pos = 0;
+static size_t log_dequeue_pos = 0;
+static uint64_t log_dropped = 0;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_thread_started = PTHREAD_ONCE_INIT;
 
-  if (!strcmp(symbol, "XCreateIC")) { return XCreateIC; }
-  if (!strcmp(symbol, "XEventsQueued")) { return XEventsQueued; }
-  if (!strcmp(symbol, "XFilterEvent")) { return XFilterEvent; }
-  if (!strcmp(symbol, "XNextEvent")) { return XNextEvent; }
-  if (!strcmp(symbol, "XOpenIM")) { return XOpenIM; }
-  if (!strcmp(symbol, "XPending")) { return XPending; }
-  if (!strcmp(symbol, "Xutf8LookupString")) { return Xutf8LookupString; }
+#define LOG(level, fmt, str, a, b) do { \
+  if (__builtin_expect((level) <= log_level, 0)) { _log_push((fmt), (str), (long long)(a), (long long)(b)); } \
+} while (0)
+
+// Only call this with log_drain_lock held!
+static void _log_drain_locked(void) {
+  for (;;) {
+    size_t pos = log_dequeue_pos;
+    struct log_record *r = &log_ring[pos & (LOG_RING_SIZE - 1)];
+    if (ATOMIC_LOAD(&r->seq) != pos + 1) { break; } // Nothing more to read
+    fprintf(stderr, r->fmt, r->str, r->a, r->b);
+    ATOMIC_STORE(&r->seq, pos + LOG_RING_SIZE);
+    log_dequeue_pos = pos + 1;
+  }
+
+  uint64_t dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped != 0) {
+    fprintf(stderr, "ForceIMESupport: log ring was full, dropped %llu messages\n", (unsigned long long)dropped);
+  }
+  fflush(stderr);
+}
+
+static void _log_drain(void) {
+  pthread_mutex_lock(&log_drain_lock);
+  _log_drain_locked();
+  pthread_mutex_unlock(&log_drain_lock);
+}
+
+static void *_log_thread(void *arg) {
+  (void)arg;
+  for (;;) {
+    _log_drain();
+    struct timespec delay = { 0, 20 * 1000 * 1000 };
+    nanosleep(&delay, NULL);
+  }
+  return NULL;
+}
+
+static void _start_log_thread(void) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, _log_thread, NULL) == 0) {
+    pthread_detach(thread);
+  }
+  // If that failed, we still drain at exit.
+}
+
+static void _log_push(const char *fmt, const char *str, long long a, long long b) {
+  pthread_once(&log_thread_started, _start_log_thread);
+
+  size_t pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+  struct log_record *r;
+  for (;;) {
+    r = &log_ring[pos & (LOG_RING_SIZE - 1)];
+    size_t seq = ATOMIC_LOAD(&r->seq);
+    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos + 1, True, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { break; }
+    } else if (dif < 0) {
+      __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+      LIVE_COUNT(log_dropped);
+      return;
+    } else {
+      pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  r->ns = _now_ns();
+  r->fmt = fmt;
+  if (str != NULL) {
+    strncpy(r->str, str, LOG_STR_BYTES - 1);
+    r->str[LOG_STR_BYTES - 1] = '\0';
+  } else {
+    r->str[0] = '\0';
+  }
+  r->a = a;
+  r->b = b;
+  ATOMIC_STORE(&r->seq, pos + 1);
+}
+
+static void _setup_log(void) {
+  for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+    log_ring[i].seq = i;
+  }
+
+  const char *level = _config("FORCEIME_LOG");
+  if (level == NULL || !strcmp(level, "info")) {
+    log_level = LOG_INFO;
+  } else if (!strcmp(level, "off")) {
+    log_level = LOG_OFF;
+  } else if (!strcmp(level, "error")) {
+    log_level = LOG_ERROR;
+  } else if (!strcmp(level, "warn")) {
+    log_level = LOG_WARN;
+  } else if (!strcmp(level, "debug")) {
+    log_level = LOG_DEBUG;
+  } else {
+    fprintf(stderr, "ForceIMESupport: unknown FORCEIME_LOG \"%s\", using \"info\"\n", level);
+  }
+
+  atexit(_log_drain);
+}
 
-  return dlsym(handle, symbol);
+//
+// IM round trips.
+//
+// The real XFilterEvent() and XCreateIC() can both stop and wait for the IM server (ibus, fcitx, ...) to answer.
+// When it's slow, so is the program's frame, and it looks like the game stuttered.
+// So we time every real call to them, and keep a histogram for each sort of event XFilterEvent() got. XCreateIC() gets its own.
+// We also keep a tally per keycode, in case it's only some keys the IM is slow about. (Ours have keycode 0.)
+//
+// A call over FORCEIME_IM_BUDGET_US (default: 2000) gets counted, and logged as a warning.
+//
+// This only happens with FORCEIME_STATS_FILE, FORCEIME_LIVE_STATS or FORCEIME_IM_BUDGET_US set. Otherwise, nothing gets timed.
+// The histograms go in FORCEIME_STATS_FILE, and the totals go in the live stats.
+//
+enum im_class {
+  IM_KEY_PRESS,
+  IM_KEY_RELEASE,
+  IM_FOCUS,
+  IM_CLIENT_MESSAGE, // The IM protocol itself, with most servers
+  IM_OTHER_EVENT,
+  IM_CREATE_IC,
+  IM_CLASS_COUNT,
+};
+static const char *im_class_names[IM_CLASS_COUNT] = {
+  [IM_KEY_PRESS] = "im_round_trip.key_press",
+  [IM_KEY_RELEASE] = "im_round_trip.key_release",
+  [IM_FOCUS] = "im_round_trip.focus",
+  [IM_CLIENT_MESSAGE] = "im_round_trip.client_message",
+  [IM_OTHER_EVENT] = "im_round_trip.other_event",
+  [IM_CREATE_IC] = "im_round_trip.create_ic",
+};
+static struct histogram im_round_trip_hist[IM_CLASS_COUNT];
+
+struct im_keycode_stats {
+  uint64_t calls;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t over_budget;
+};
+static struct im_keycode_stats im_keycodes[256];
+
+static Bool im_timing = False;
+static uint64_t im_budget_ns = 2000000;
+static uint64_t im_calls = 0;
+static uint64_t im_over_budget = 0;
+static struct xlib_functions untimed_real;
+
+static inline uint64_t _im_clock(void) {
+  return (im_timing ? _now_ns() : 0);
+}
+
+// t0 comes from _im_clock(). For XCreateIC(), event is NULL.
+static void _im_round_trip(const XEvent *event, uint64_t t0) {
+  if (!im_timing) { return; }
+  uint64_t ns = _now_ns() - t0;
+
+  enum im_class c = IM_CREATE_IC;
+  if (event != NULL) {
+    switch (event->type) {
+      case KeyPress: c = IM_KEY_PRESS; break;
+      case KeyRelease: c = IM_KEY_RELEASE; break;
+      case FocusIn: case FocusOut: c = IM_FOCUS; break;
+      case ClientMessage: c = IM_CLIENT_MESSAGE; break;
+      default: c = IM_OTHER_EVENT; break;
+    }
+  }
+  _hist_record(&im_round_trip_hist[c], ns);
+  __atomic_add_fetch(&im_calls, 1, __ATOMIC_RELAXED);
+  uint64_t max;
+  if (live_stats != NULL) {
+    __atomic_add_fetch(&live_stats->im_round_trips, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&live_stats->im_round_trip_ns, ns, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&live_stats->im_max_round_trip_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&live_stats->im_max_round_trip_ns, &max, ns, True, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+  }
+
+  Bool over = (ns > im_budget_ns);
+  struct im_keycode_stats *k = NULL;
+  if (c == IM_KEY_PRESS || c == IM_KEY_RELEASE) {
+    k = &im_keycodes[event->xkey.keycode & 0xFF];
+    __atomic_add_fetch(&k->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&k->sum_ns, ns, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&k->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&k->max_ns, &max, ns, True, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    if (over) { __atomic_add_fetch(&k->over_budget, 1, __ATOMIC_RELAXED); }
+  }
+  if (!over) { return; }
+
+  __atomic_add_fetch(&im_over_budget, 1, __ATOMIC_RELAXED);
+  LIVE_COUNT(im_over_budget);
+  PROBE(im_over_budget, (event != NULL ? event->type : 0), ns);
+  if (event == NULL) {
+    LOG(LOG_WARN, "ForceIMESupport: real XCreateIC took %.0s%lldus, over the IM budget\n", NULL, ns / 1000, 0);
+  } else if (k != NULL) {
+    LOG(LOG_WARN, "ForceIMESupport: real XFilterEvent took %.0s%lldus, over the IM budget (keycode %lld)\n", NULL, ns / 1000, event->xkey.keycode);
+  } else {
+    LOG(LOG_WARN, "ForceIMESupport: real XFilterEvent took %.0s%lldus, over the IM budget (event type %lld)\n", NULL, ns / 1000, event->type);
+  }
+}
+
+static Bool _timed_real_XFilterEvent(XEvent *event, Window w) {
+  uint64_t t0 = _now_ns();
+  Bool result = untimed_real.XFilterEvent(event, w);
+  _im_round_trip(event, t0);
+  return result;
+}
+
+static void _write_im_stats(FILE *fp) {
+  if (!im_timing) { return; }
+  fprintf(fp, "im_budget: budget=%lluns calls=%llu over_budget=%llu\n", (unsigned long long)im_budget_ns,
+    (unsigned long long)__atomic_load_n(&im_calls, __ATOMIC_RELAXED),
+    (unsigned long long)__atomic_load_n(&im_over_budget, __ATOMIC_RELAXED));
+  for (int i = 0; i < IM_CLASS_COUNT; i++) {
+    if (__atomic_load_n(&im_round_trip_hist[i].count, __ATOMIC_RELAXED) == 0) { continue; }
+    _hist_write(fp, im_class_names[i], "ns", &im_round_trip_hist[i]);
+  }
+  for (int i = 0; i < 256; i++) {
+    uint64_t calls = __atomic_load_n(&im_keycodes[i].calls, __ATOMIC_RELAXED);
+    if (calls == 0) { continue; }
+    fprintf(fp, "im_keycode %d: calls=%llu mean=%lluns max=%lluns over_budget=%llu\n", i, (unsigned long long)calls,
+      (unsigned long long)(__atomic_load_n(&im_keycodes[i].sum_ns, __ATOMIC_RELAXED) / calls),
+      (unsigned long long)__atomic_load_n(&im_keycodes[i].max_ns, __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&im_keycodes[i].over_budget, __ATOMIC_RELAXED));
+  }
+}
+
+// This needs to go after _setup_live_stats() and _setup_stats().
+static void _setup_im_timing(void) {
+  const char *budget = _config("FORCEIME_IM_BUDGET_US");
+  if (budget != NULL && atoi(budget) > 0) {
+    im_budget_ns = (uint64_t)atoi(budget) * 1000;
+    im_timing = True;
+  }
+  if (stats_file != NULL || live_stats != NULL) {
+    im_timing = True;
+  }
+}
+
+//
+// Recording.
+//
+// Set FORCEIME_RECORD to a path, and we write every hooked call the program makes (and every real call we make)
+// to it in the format described in ForceIMETrace.h. ForceIMEReplay can then play it back against the shim.
+//
+// The file is memory-mapped and preallocated - FORCEIME_RECORD_MB megabytes of it (default: 64).
+// Writers reserve space with one atomic add, and never wait on anything. Once it's full, further records get counted and dropped.
+// At exit, the file gets trimmed down to what was actually used.
+//
+static struct forceime_trace_header *trace = NULL;
+static int trace_fd = -1;
+
+static void _trace_event(struct forceime_trace_event *out, const XEvent *event) {
+  out->type = event->type;
+  out->window = event->xany.window;
+  if (event->type == KeyPress || event->type == KeyRelease) {
+    out->keycode = event->xkey.keycode;
+    out->state = event->xkey.state;
+    out->time = (uint32_t)event->xkey.time;
+  }
+}
+
+static void _trace_ic(int kind, int func, uint64_t start_ns, XIC ic, int arg, int result, const XEvent *event, const void *payload, uint32_t payload_len) {
+  // Once recording's finished, the wrappers are still in place, but there's nowhere to put anything.
+  struct forceime_trace_header *t = trace;
+  if (t == NULL) { return; }
+  uint64_t end_ns = _now_ns();
+  uint32_t size = (sizeof(struct forceime_trace_record) + payload_len + 7) & ~7u;
+  uint64_t off = __atomic_fetch_add(&t->used, size, __ATOMIC_RELAXED);
+  if (off + size > t->capacity) {
+    // Leave used where it was, or we'd be claiming records which aren't there.
+    __atomic_sub_fetch(&t->used, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->dropped, 1, __ATOMIC_RELAXED);
+    LIVE_COUNT(trace_dropped);
+    return;
+  }
+
+  struct forceime_trace_record *r = (struct forceime_trace_record *)((char *)t + t->header_size + off);
+  memset(r, 0, sizeof(*r));
+  r->ns = start_ns - t->start_ns;
+  r->dur_ns = end_ns - start_ns;
+  r->kind = kind;
+  r->func = func;
+  r->record_size = size;
+  r->arg = arg;
+  r->result = result;
+  r->payload_len = payload_len;
+  r->ic = (uintptr_t)ic;
+  if (event != NULL) {
+    _trace_event(&r->event, event);
+  }
+  if (payload_len > 0) {
+    memcpy(r + 1, payload, payload_len);
+  }
+}
+
+static void _trace(int kind, int func, uint64_t start_ns, int arg, int result, const XEvent *event, const void *payload, uint32_t payload_len) {
+  _trace_ic(kind, func, start_ns, NULL, arg, result, event, payload, payload_len);
+}
+
+//
+// For the calls that look for an event: what turned up, or if nothing did, just the window that was asked about.
+//
+static void _trace_search(int kind, int func, uint64_t start_ns, int arg, int result, Bool found, const XEvent *event, Window w) {
+  XEvent nothing;
+  if (!found) {
+    memset(&nothing, 0, sizeof(nothing));
+    nothing.xany.window = w;
+    event = &nothing;
+  }
+  _trace(kind, func, start_ns, arg, result, event, NULL, 0);
+}
+
+static void _finish_trace(void) {
+  // Once something's in the file, we can't take it back out. So we just stop adding to it.
+  struct forceime_trace_header *t = trace;
+  trace = NULL;
+  uint64_t size = t->header_size + __atomic_load_n(&t->used, __ATOMIC_RELAXED);
+  if (t->dropped != 0) {
+    fprintf(stderr, "ForceIMESupport: trace filled up, dropped %llu records\n", (unsigned long long)t->dropped);
+  }
+  msync(t, size, MS_SYNC);
+  if (ftruncate(trace_fd, size) != 0) {
+    fprintf(stderr, "ForceIMESupport: could not trim trace file\n");
+  }
+  close(trace_fd);
+}
+
+static void _setup_trace(void) {
+  const char *path = _config("FORCEIME_RECORD");
+  if (path == NULL || path[0] == '\0') { return; }
+
+  uint64_t capacity = 64;
+  const char *mb = _config("FORCEIME_RECORD_MB");
+  if (mb != NULL && atoi(mb) > 0) { capacity = atoi(mb); }
+  capacity *= 1024 * 1024;
+
+  size_t size = sizeof(struct forceime_trace_header) + capacity;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    fprintf(stderr, "ForceIMESupport: could not create trace file \"%s\"\n", path);
+    if (fd >= 0) { close(fd); }
+    return;
+  }
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "ForceIMESupport: could not map trace file \"%s\"\n", path);
+    close(fd);
+    return;
+  }
+
+  struct forceime_trace_header *t = map;
+  memcpy(t->magic, FORCEIME_TRACE_MAGIC, sizeof(t->magic));
+  t->version = FORCEIME_TRACE_VERSION;
+  t->header_size = sizeof(struct forceime_trace_header);
+  t->start_ns = _now_ns();
+  t->used = 0;
+  t->capacity = capacity;
+  t->dropped = 0;
+  trace_fd = fd;
+  trace = t;
+  atexit(_finish_trace);
+}
+
+//
+// While recording, the real functions we record calls to get swapped out for these (see _select_hooks()),
+// and untraced_real has the actual ones. When we're not recording, nothing here gets called at all.
+//
+static struct xlib_functions untraced_real;
+
+static int _traced_real_XNextEvent(Display *display, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XNextEvent(display, event_return);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XNextEvent, t0, 0, result, event_return, NULL, 0);
+  return result;
+}
+
+static int _traced_real_XPending(Display *display) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XPending(display);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XPending, t0, 0, result, NULL, NULL, 0);
+  return result;
+}
+
+static int _traced_real_XEventsQueued(Display *display, int mode) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XEventsQueued(display, mode);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XEventsQueued, t0, mode, result, NULL, NULL, 0);
+  return result;
+}
+
+static Bool _traced_real_XCheckTypedEvent(Display *display, int event_type, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  Bool result = untraced_real.XCheckTypedEvent(display, event_type, event_return);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XCheckTypedEvent, t0, event_type, result, (result ? event_return : NULL), NULL, 0);
+  return result;
+}
+
+static Bool _traced_real_XCheckTypedWindowEvent(Display *display, Window w, int event_type, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  Bool result = untraced_real.XCheckTypedWindowEvent(display, w, event_type, event_return);
+  _trace_search(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XCheckTypedWindowEvent, t0, event_type, result, result, event_return, w);
+  return result;
+}
+
+static int _traced_real_XPeekEvent(Display *display, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XPeekEvent(display, event_return);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XPeekEvent, t0, 0, result, event_return, NULL, 0);
+  return result;
+}
+
+static int _traced_real_XIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XIfEvent(display, event_return, predicate, arg);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XIfEvent, t0, 0, result, event_return, NULL, 0);
+  return result;
+}
+
+static Bool _traced_real_XCheckIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  uint64_t t0 = _now_ns();
+  Bool result = untraced_real.XCheckIfEvent(display, event_return, predicate, arg);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XCheckIfEvent, t0, 0, result, (result ? event_return : NULL), NULL, 0);
+  return result;
+}
+
+static int _traced_real_XPeekIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XPeekIfEvent(display, event_return, predicate, arg);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XPeekIfEvent, t0, 0, result, event_return, NULL, 0);
+  return result;
+}
+
+static int _traced_real_XMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XMaskEvent(display, event_mask, event_return);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XMaskEvent, t0, (int)event_mask, result, event_return, NULL, 0);
+  return result;
+}
+
+static Bool _traced_real_XCheckMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  Bool result = untraced_real.XCheckMaskEvent(display, event_mask, event_return);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XCheckMaskEvent, t0, (int)event_mask, result, (result ? event_return : NULL), NULL, 0);
+  return result;
+}
+
+static int _traced_real_XWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XWindowEvent(display, w, event_mask, event_return);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XWindowEvent, t0, (int)event_mask, result, event_return, NULL, 0);
+  return result;
+}
+
+static Bool _traced_real_XCheckWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  Bool result = untraced_real.XCheckWindowEvent(display, w, event_mask, event_return);
+  _trace_search(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XCheckWindowEvent, t0, (int)event_mask, result, result, event_return, w);
+  return result;
+}
+
+static Bool _traced_real_XFilterEvent(XEvent *event, Window w) {
+  uint64_t t0 = _now_ns();
+  Bool result = untraced_real.XFilterEvent(event, w);
+  _trace(FORCEIME_TRACE_REAL, FORCEIME_TRACE_XFilterEvent, t0, 0, result, event, NULL, 0);
+  return result;
+}
+
+//
+// The three *LookupString() functions only differ in what they put in the buffer.
+// Lengths are in units of whatever that is - bytes, or wchar_ts.
+//
+enum lookup_encoding {
+  LOOKUP_UTF8,
+  LOOKUP_MB,
+  LOOKUP_WC,
+};
+
+static const int lookup_trace_func[] = {
+  [LOOKUP_UTF8] = FORCEIME_TRACE_Xutf8LookupString,
+  [LOOKUP_MB] = FORCEIME_TRACE_XmbLookupString,
+  [LOOKUP_WC] = FORCEIME_TRACE_XwcLookupString,
+};
+
+static const int lookup_unit_size[] = {
+  [LOOKUP_UTF8] = 1,
+  [LOOKUP_MB] = 1,
+  [LOOKUP_WC] = sizeof(wchar_t),
+};
+
+static void _trace_lookup(int kind, enum lookup_encoding encoding, uint64_t t0, XIC ic, int result, XKeyPressedEvent *event, void *buffer_return, Status *status_return) {
+  Bool has_text = (result > 0 && *status_return != XBufferOverflow);
+  _trace_ic(kind, lookup_trace_func[encoding], t0, ic, *status_return, result, (XEvent *)event,
+    buffer_return, (has_text ? result * lookup_unit_size[encoding] : 0));
+}
+
+static int _traced_real_Xutf8LookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.Xutf8LookupString(ic, event, buffer_return, bytes_buffer, keysym_return, status_return);
+  _trace_lookup(FORCEIME_TRACE_REAL, LOOKUP_UTF8, t0, ic, result, event, buffer_return, status_return);
+  return result;
+}
+
+static int _traced_real_XmbLookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XmbLookupString(ic, event, buffer_return, bytes_buffer, keysym_return, status_return);
+  _trace_lookup(FORCEIME_TRACE_REAL, LOOKUP_MB, t0, ic, result, event, buffer_return, status_return);
+  return result;
+}
+
+static int _traced_real_XwcLookupString(XIC ic, XKeyPressedEvent *event, wchar_t *buffer_return, int wchars_buffer, KeySym *keysym_return, Status *status_return) {
+  uint64_t t0 = _now_ns();
+  int result = untraced_real.XwcLookupString(ic, event, buffer_return, wchars_buffer, keysym_return, status_return);
+  _trace_lookup(FORCEIME_TRACE_REAL, LOOKUP_WC, t0, ic, result, event, buffer_return, status_return);
+  return result;
+}
+
+static int _real_lookup_string(enum lookup_encoding encoding, XIC ic, XKeyPressedEvent *event, void *buffer_return, int buffer_len, KeySym *keysym_return, Status *status_return) {
+  switch (encoding) {
+    case LOOKUP_MB: return real.XmbLookupString(ic, event, buffer_return, buffer_len, keysym_return, status_return);
+    case LOOKUP_WC: return real.XwcLookupString(ic, event, buffer_return, buffer_len, keysym_return, status_return);
+    default: return real.Xutf8LookupString(ic, event, buffer_return, buffer_len, keysym_return, status_return);
+  }
+}
+
+//
+// When calling Xutf8LookupString:
+// Unity 2019 accepts as much data as it can, but then only uses the first character.
+// (XmbLookupString() and XwcLookupString() get the same treatment, in case a toolkit does the same thing with those.)
+// This is NOT how an IME behaves on Linux - you get multiple characters in one call.
+//
+// We need to create a buffer to work around this.
+//
+// This is a list of fixed-size chunks (see text_chunk below), so there's no upper limit on how much an IME can commit at once,
+// and we never have to move anything we've already queued.
+// first_off is how far into the first chunk we've handed out so far.
+//
+// The queue always holds UTF-8, whichever *LookupString() the text came in through.
+// It gets converted into whatever the caller wants one character at a time, on the way out (see _encode_char()).
+//
+// head and tail count how many bytes we've handed out and queued, and only ever count upwards.
+// Unsigned wraparound keeps (tail - head) correct, so that's how many bytes are queued.
+//
+// chars is how many characters that works out to, for DELIVERY_BURST.
+//
+// queued_ns is when the text currently queued turned up. We only queue more once the queue is empty,
+// so that's the same for every character in it.
+//
+// last_key_event is used as a dummy event to return from XNextEvent() when we need to pass more characters to Unity.
+//
+// Thread safety:
+// - head, tail and chars are only ever changed by whoever has claimed the queue (see _queue_claim()),
+//   and get published with release stores. Anyone can read them without taking anything.
+//   On x86, all of that compiles down to plain loads and stores.
+// - Claiming never waits. If another thread has the queue, the hook just behaves as if we weren't buffering anything.
+// - last_key_event gets copied around in one piece, so it's guarded by a sequence counter.
+//   Readers retry if it changed underneath them, and writers need the queue claimed.
+// - display and window say whose queue it is. They only change with the queue claimed, when it gets handed out or taken back.
+//   Queues get recycled, so whoever looked one up has to check these once they've claimed it. See _claim_window_queue().
+//
+//
+// Queued text lives in these.
+// They come out of an arena which only ever grows, a block of chunks at a time, and get recycled through a free list.
+// That takes a lock once the program's threaded, so each queue also keeps the chunks it's finished with, for its next commit.
+// Handing text out never takes the lock, and queueing only does when a queue needs more chunks than it's ever had.
+// They go back to the arena when the queue does.
+// A character never gets split across two chunks.
+//
+// Text gets checked when it's queued (see _utf8_sanitize()), and we note down where each character starts.
+// Handing out a character is then just finding the next start bit.
+//
+#define TEXT_CHUNK_BYTES 240
+#define TEXT_CHUNKS_PER_BLOCK 64
+struct text_chunk {
+  struct text_chunk *next;
+  unsigned int used;
+  uint64_t starts[(TEXT_CHUNK_BYTES + 63) / 64]; // Bit n is set if a character starts at bytes[n]
+  unsigned char bytes[TEXT_CHUNK_BYTES];
+};
+static struct text_chunk *text_chunk_free = NULL;
+static pthread_mutex_t text_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct text_queue {
+  struct text_chunk *first;
+  struct text_chunk *last;
+  unsigned int first_off;
+  uint64_t queued_ns;
+  unsigned int head;
+  unsigned int tail;
+  int chars;
+  int synthetic_streak; // See _schedule_real_event()
+  char busy;
+  unsigned int key_seq;
+  XEvent last_key_event;
+  Bool has_staged;      // See _stage_event()
+  XEvent staged_event;
+  Display *display;
+  Window window;
+  struct text_chunk *spare; // Chunks we're done with. Only touched with the queue claimed.
+  struct text_queue *next_free;
+};
+
+static inline int _text_string_used(const struct text_queue *q) {
+  return (int)(ATOMIC_LOAD(&q->tail) - ATOMIC_LOAD(&q->head));
+}
+
+static inline Bool _queue_claim(struct text_queue *q) {
+  if (!threaded) { return True; }
+  return !__atomic_test_and_set(&q->busy, __ATOMIC_ACQUIRE);
+}
+
+static inline void _queue_unclaim(struct text_queue *q) {
+  if (!threaded) { return; }
+  __atomic_clear(&q->busy, __ATOMIC_RELEASE);
+}
+
+// Only call this with the queue claimed!
+static void _set_last_key_event(struct text_queue *q, const XEvent *event) {
+  unsigned int seq = q->key_seq;
+  __atomic_store_n(&q->key_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  q->last_key_event = *event;
+  ATOMIC_STORE(&q->key_seq, seq + 2);
+}
+
+static void _get_last_key_event(struct text_queue *q, XEvent *event_return) {
+  for (;;) {
+    unsigned int seq = ATOMIC_LOAD(&q->key_seq);
+    if ((seq & 1) == 0) {
+      *event_return = q->last_key_event;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&q->key_seq, __ATOMIC_RELAXED) == seq) { return; }
+    }
+  }
+}
+
+//
+// Each window on each Display gets its own queue, so text typed into one doesn't turn up in another.
+//
+// The table itself is small and gets scanned linearly - it's only the keys and a pointer, so it all fits in a few cache lines.
+// The queues themselves are big, so they come out of a fixed slab and get recycled through a free list.
+//
+// When the table fills up, we evict a state with nothing queued. If everything has text queued, we give up on buffering for that window.
+//
+// Looking things up never takes a lock. Adding and removing states does, but that only happens when a new window shows up.
+// A state's queue pointer gets set last and cleared first, so a lookup never sees a half-built state.
+// A lookup can still find a state just before it's evicted, though, so queues know whose they are. See _claim_window_queue().
+//
+#define MAX_IME_STATES 16
+struct ime_state {
+  Display *display;
+  Window window;
+  XIC ic;
+  struct text_queue *queue;
+};
+static struct ime_state ime_states[MAX_IME_STATES];
+static struct text_queue text_queue_slab[MAX_IME_STATES];
+static struct text_queue *text_queue_free = NULL;
+static int text_queue_slab_used = 0;
+static pthread_mutex_t ime_states_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// How many queues have text in them right now. If it's 0, the hooks don't need to look at the table at all.
+//
+static int queues_with_text = 0;
+
+//
+// How many queues have a real event staged (see _stage_event()). Same idea.
+//
+static int staged_events = 0;
+
+// Only call this with the queue claimed!
+static struct text_chunk *_text_chunk_alloc(struct text_queue *q) {
+  struct text_chunk *c = q->spare;
+  if (c != NULL) {
+    q->spare = c->next;
+  } else {
+    if (threaded) { pthread_mutex_lock(&text_chunk_lock); }
+    if (text_chunk_free == NULL) {
+      struct text_chunk *block = malloc(sizeof(struct text_chunk) * TEXT_CHUNKS_PER_BLOCK);
+      if (block != NULL) {
+        for (int i = 0; i < TEXT_CHUNKS_PER_BLOCK; i++) {
+          block[i].next = text_chunk_free;
+          text_chunk_free = &block[i];
+        }
+      }
+    }
+    c = text_chunk_free;
+    if (c != NULL) { text_chunk_free = c->next; }
+    if (threaded) { pthread_mutex_unlock(&text_chunk_lock); }
+  }
+  if (c != NULL) {
+    c->next = NULL;
+    c->used = 0;
+    memset(c->starts, 0, sizeof(c->starts));
+  }
+  return c;
+}
+
+static void _text_chunk_free_list(struct text_chunk *first, struct text_chunk *last) {
+  if (threaded) { pthread_mutex_lock(&text_chunk_lock); }
+  last->next = text_chunk_free;
+  text_chunk_free = first;
+  if (threaded) { pthread_mutex_unlock(&text_chunk_lock); }
+}
+
+// Only call this with ime_states_lock held!
+static struct text_queue *_text_queue_alloc(Display *display, Window window) {
+  struct text_queue *q = text_queue_free;
+  if (q != NULL) {
+    text_queue_free = q->next_free;
+  } else {
+    assert(text_queue_slab_used < MAX_IME_STATES);
+    q = &text_queue_slab[text_queue_slab_used++];
+  }
+  // Someone who found this queue before it was freed might still claim it. They'll see it's not theirs any more,
+  // but only if we set it up claimed.
+  while (!_queue_claim(q)) {}
+  q->first = NULL;
+  q->last = NULL;
+  q->first_off = 0;
+  q->head = 0;
+  q->tail = 0;
+  q->chars = 0;
+  q->synthetic_streak = 0;
+  memset(&q->last_key_event, 0, sizeof(q->last_key_event));
+  q->has_staged = False;
+  q->next_free = NULL;
+  ATOMIC_STORE(&q->display, display);
+  ATOMIC_STORE(&q->window, window);
+  _queue_unclaim(q);
+  return q;
+}
+
+// Only call this with ime_states_lock held!
+// With only_if_empty set, a state with text queued gets left alone, and this returns False.
+// (Checking beforehand isn't enough. Whoever has the queue claimed could be queueing text right now.)
+static Bool _ime_state_release(struct ime_state *st, Bool only_if_empty) {
+  struct text_queue *q = st->queue;
+  if (q != NULL) {
+    // Wait for whoever's using it to finish. This isn't a hot path, and they won't be long.
+    while (!_queue_claim(q)) {}
+    if (only_if_empty && _text_string_used(q) > 0) {
+      _queue_unclaim(q);
+      return False;
+    }
+    ATOMIC_STORE(&st->queue, NULL);
+    if (_text_string_used(q) > 0) {
+      __atomic_sub_fetch(&queues_with_text, 1, __ATOMIC_RELEASE);
+      LIVE_ADD(chars_dropped, q->chars);
+      _queue_depth_change(-(int64_t)q->chars);
+    }
+    ATOMIC_STORE(&q->head, q->tail);
+    if (q->first != NULL) {
+      _text_chunk_free_list(q->first, q->last);
+      q->first = NULL;
+      q->last = NULL;
+    }
+    if (q->spare != NULL) {
+      struct text_chunk *last = q->spare;
+      while (last->next != NULL) { last = last->next; }
+      _text_chunk_free_list(q->spare, last);
+      q->spare = NULL;
+    }
+    ATOMIC_STORE(&q->display, NULL);
+    ATOMIC_STORE(&q->window, 0);
+    _queue_unclaim(q);
+
+    // Don't lose a real event we were holding on to. Put it back where Xlib will find it.
+    if (q->has_staged) {
+      q->has_staged = False;
+      __atomic_sub_fetch(&staged_events, 1, __ATOMIC_RELEASE);
+      real.XPutBackEvent(st->display, &q->staged_event);
+    }
+
+    q->next_free = text_queue_free;
+    text_queue_free = q;
+  }
+  ATOMIC_STORE(&st->display, NULL);
+  ATOMIC_STORE(&st->window, 0);
+  st->ic = NULL;
+  return True;
+}
+
+// What this finds might get evicted the moment it's returned. Check with _queue_owned_by() before trusting its queue.
+static struct ime_state *_ime_state_find(Display *display, Window window) {
+  for (int i = 0; i < MAX_IME_STATES; i++) {
+    if (ATOMIC_LOAD(&ime_states[i].queue) != NULL && ATOMIC_LOAD(&ime_states[i].display) == display
+      && ATOMIC_LOAD(&ime_states[i].window) == window) {
+      return &ime_states[i];
+    }
+  }
+  return NULL;
+}
+
+static struct ime_state *_ime_state_get(Display *display, Window window) {
+  struct ime_state *st = _ime_state_find(display, window);
+  if (st != NULL) { return st; }
+
+  if (threaded) { pthread_mutex_lock(&ime_states_lock); }
+
+  // Someone else might have beaten us to it.
+  st = _ime_state_find(display, window);
+  if (st == NULL) {
+    struct ime_state *victim = NULL;
+    for (int i = 0; i < MAX_IME_STATES && victim == NULL; i++) {
+      if (ime_states[i].queue == NULL) { victim = &ime_states[i]; }
+    }
+    for (int i = 0; i < MAX_IME_STATES && victim == NULL; i++) {
+      if (_text_string_used(ime_states[i].queue) == 0 && _ime_state_release(&ime_states[i], True)) { victim = &ime_states[i]; }
+    }
+    if (victim != NULL) {
+      ATOMIC_STORE(&victim->display, display);
+      ATOMIC_STORE(&victim->window, window);
+      ATOMIC_STORE(&victim->queue, _text_queue_alloc(display, window));
+      st = victim;
+    }
+  }
+
+  if (threaded) { pthread_mutex_unlock(&ime_states_lock); }
+  return st;
+}
+
+static inline Bool _queue_owned_by(struct text_queue *q, Display *display, Window window) {
+  return ATOMIC_LOAD(&q->display) == display && ATOMIC_LOAD(&q->window) == window;
+}
+
+//
+// Finds this window's queue (making one if create is set) and claims it.
+// Returns NULL if there isn't one, or another thread has it. st_return, if set, gets the state it belongs to.
+//
+// Finding a queue doesn't stop it getting evicted, and the free list is LIFO, so it can go straight back out to another window
+// in the same slot. So once we've claimed it, we check it's still ours. If not, look again.
+//
+static struct text_queue *_claim_window_queue(Display *display, Window window, Bool create, struct ime_state **st_return) {
+  for (;;) {
+    struct ime_state *st = (create ? _ime_state_get(display, window) : _ime_state_find(display, window));
+    struct text_queue *q = (st != NULL ? ATOMIC_LOAD(&st->queue) : NULL);
+    if (q == NULL || !_queue_claim(q)) { return NULL; }
+    if (_queue_owned_by(q, display, window) && ATOMIC_LOAD(&st->queue) == q) {
+      if (st_return != NULL) { *st_return = st; }
+      return q;
+    }
+    _queue_unclaim(q);
+  }
+}
+
+//
+// Finds the first window on this Display which has text waiting, and returns its queue.
+//
+static struct text_queue *_pending_queue(Display *display) {
+  if (ATOMIC_LOAD(&queues_with_text) == 0) { return NULL; }
+  for (int i = 0; i < MAX_IME_STATES; i++) {
+    struct text_queue *q = ATOMIC_LOAD(&ime_states[i].queue);
+    if (q != NULL && ATOMIC_LOAD(&ime_states[i].display) == display && _text_string_used(q) > 0) {
+      return q;
+    }
+  }
+  return NULL;
+}
+
+//
+// How many characters this Display has waiting, across all of its windows.
+// If queued_ns isn't NULL, it gets when the first of them turned up, from the same look at the queues.
+// (Looking again afterwards isn't safe. Another thread might have emptied them in between.)
+//
+static int _pending_chars(Display *display, uint64_t *queued_ns) {
+  if (ATOMIC_LOAD(&queues_with_text) == 0) { return 0; }
+  int chars = 0;
+  for (int i = 0; i < MAX_IME_STATES; i++) {
+    struct text_queue *q = ATOMIC_LOAD(&ime_states[i].queue);
+    if (q != NULL && ATOMIC_LOAD(&ime_states[i].display) == display && _text_string_used(q) > 0) {
+      if (chars == 0 && queued_ns != NULL) { *queued_ns = q->queued_ns; }
+      chars += ATOMIC_LOAD(&q->chars);
+    }
+  }
+  return chars;
+}
+
+//
+// Finds the queue holding this Display's staged event, if it has one. See _stage_event().
+//
+static struct text_queue *_staged_queue(Display *display) {
+  if (ATOMIC_LOAD(&staged_events) == 0) { return NULL; }
+  for (int i = 0; i < MAX_IME_STATES; i++) {
+    struct text_queue *q = ATOMIC_LOAD(&ime_states[i].queue);
+    if (q != NULL && ATOMIC_LOAD(&ime_states[i].display) == display && ATOMIC_LOAD(&q->has_staged)) {
+      return q;
+    }
+  }
+  return NULL;
+}
+
+static int _staged_count(Display *display) {
+  return (_staged_queue(display) != NULL ? 1 : 0);
+}
+
+//
+// These are helper functions for dealing with UTF-8 data.
+//
+// Whatever the IM hands us gets checked exactly once, on the way into the queue:
+// - _utf8_char_len() tells us how long a valid character is, or 0 if it isn't one.
+//   Overlong forms, surrogates, anything past U+10FFFF and truncated sequences are all invalid.
+// - _utf8_sanitize() replaces every byte which isn't part of a valid character with a '?'.
+//   With SSE2, it checks 16 bytes at a time (see _utf8_block_valid()), and only goes a character at a time around bad bytes,
+//   and at the very end. Without it, it can only skip over ASCII, 8 bytes at a time.
+// - _mark_char_starts() sets the start bits for some text which has already been sanitized, and counts the characters.
+//   After sanitizing, a character starts at every byte which isn't a continuation byte, so this is also done 16 bytes at a time.
+//
+// _buf_char_len() tells us the length of the character at the head of a queue.
+//
+static int _utf8_char_len(const unsigned char *s, int avail) {
+  unsigned char c = s[0];
+  int len;
+  unsigned char lo = 0x80;
+  unsigned char hi = 0xBF;
+  if (c <= 0x7F) {
+    return 1;
+  } else if (c < 0xC2) {
+    // Continuation byte, or an overlong 2-byte form
+    return 0;
+  } else if (c <= 0xDF) {
+    len = 2;
+  } else if (c <= 0xEF) {
+    len = 3;
+    if (c == 0xE0) { lo = 0xA0; } // Overlong
+    if (c == 0xED) { hi = 0x9F; } // Surrogates
+  } else if (c <= 0xF4) {
+    len = 4;
+    if (c == 0xF0) { lo = 0x90; } // Overlong
+    if (c == 0xF4) { hi = 0x8F; } // Past U+10FFFF
+  } else {
+    return 0;
+  }
+
+  if (len > avail) { return 0; }
+  if (s[1] < lo || s[1] > hi) { return 0; }
+  for (int i = 2; i < len; i++) {
+    if ((s[i] & 0xC0) != 0x80) { return 0; }
+  }
+  return len;
+}
+
+#ifdef __SSE2__
+// Unsigned byte comparisons. SSE2 only has signed ones, but it does have unsigned min and max.
+static inline __m128i _u8_ge(__m128i v, unsigned char n) {
+  return _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8((char)n)), v);
+}
+
+static inline __m128i _u8_le(__m128i v, unsigned char n) {
+  return _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8((char)n)), v);
+}
+
+static inline __m128i _u8_eq(__m128i v, unsigned char n) {
+  return _mm_cmpeq_epi8(v, _mm_set1_epi8((char)n));
+}
+
+//
+// Checks 16 bytes of UTF-8 at once, by the same rules as _utf8_char_len(). prev is the 16 bytes before them.
+// Every byte gets checked against the three before it:
+// - It has to be a continuation byte if, and only if, one of those started a character that isn't finished yet.
+// - C0, C1 and F5-FF are never allowed.
+// - After E0, ED, F0 and F4, the first continuation byte has a narrower range. (Overlong forms, surrogates, past U+10FFFF)
+// That's enough, as long as everything in prev passed too. A character that isn't finished by the end is left for the caller.
+//
+static inline Bool _utf8_block_valid(__m128i v, __m128i prev) {
+  if (_mm_movemask_epi8(_mm_or_si128(v, prev)) == 0) { return True; } // All ASCII
+
+  __m128i prev1 = _mm_or_si128(_mm_slli_si128(v, 1), _mm_srli_si128(prev, 15));
+  __m128i prev2 = _mm_or_si128(_mm_slli_si128(v, 2), _mm_srli_si128(prev, 14));
+  __m128i prev3 = _mm_or_si128(_mm_slli_si128(v, 3), _mm_srli_si128(prev, 13));
+
+  __m128i continuation = _mm_and_si128(_u8_ge(v, 0x80), _u8_le(v, 0xBF));
+  __m128i expected = _mm_or_si128(_mm_or_si128(_u8_ge(prev1, 0xC0), _u8_ge(prev2, 0xE0)), _u8_ge(prev3, 0xF0));
+  __m128i bad = _mm_xor_si128(continuation, expected);
+  bad = _mm_or_si128(bad, _mm_or_si128(_u8_eq(v, 0xC0), _u8_eq(v, 0xC1)));
+  bad = _mm_or_si128(bad, _u8_ge(v, 0xF5));
+  bad = _mm_or_si128(bad, _mm_and_si128(_u8_eq(prev1, 0xE0), _u8_le(v, 0x9F)));
+  bad = _mm_or_si128(bad, _mm_and_si128(_u8_eq(prev1, 0xED), _u8_ge(v, 0xA0)));
+  bad = _mm_or_si128(bad, _mm_and_si128(_u8_eq(prev1, 0xF0), _u8_le(v, 0x8F)));
+  bad = _mm_or_si128(bad, _mm_and_si128(_u8_eq(prev1, 0xF4), _u8_ge(v, 0x90)));
+  return _mm_movemask_epi8(bad) == 0;
+}
+#endif
+
+static int _utf8_sanitize(unsigned char *text, int len) {
+  int replaced = 0;
+  int i = 0;
+  while (i < len) {
+#ifdef __SSE2__
+    // i is always at the start of a character here, so nothing before it is waiting for continuation bytes.
+    int start = i;
+    __m128i prev = _mm_setzero_si128();
+    while (i + 16 <= len) {
+      __m128i v = _mm_loadu_si128((const __m128i *)&text[i]);
+      if (!_utf8_block_valid(v, prev)) { break; }
+      prev = v;
+      i += 16;
+    }
+    // We might have stopped partway through a character. If so, go back to where it started, and check it properly.
+    for (int k = 1; k <= 3 && i - k >= start; k++) {
+      unsigned char c = text[i - k];
+      if (c < 0x80) { break; }
+      if (c >= 0xC0) {
+        if ((c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2) > k) { i -= k; }
+        break;
+      }
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+      uint64_t word;
+      memcpy(&word, &text[i], sizeof(word));
+      if ((word & 0x8080808080808080ull) != 0) { break; }
+    }
+#endif
+    if (i >= len) { break; }
+
+    int char_len = _utf8_char_len(&text[i], len - i);
+    if (char_len == 0) {
+      text[i] = '?';
+      replaced++;
+      char_len = 1;
+    }
+    i += char_len;
+  }
+  return replaced;
+}
+
+static inline void _set_char_starts(struct text_chunk *c, unsigned int off, uint64_t bits) {
+  c->starts[off / 64] |= bits << (off % 64);
+  if (off % 64 > 48) {
+    c->starts[off / 64 + 1] |= bits >> (64 - off % 64);
+  }
+}
+
+static int _mark_char_starts(struct text_chunk *c, unsigned int off, const unsigned char *text, int len) {
+  int chars = 0;
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&text[i]);
+    __m128i continuation = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xC0)), _mm_set1_epi8((char)0x80));
+    uint64_t bits = (~_mm_movemask_epi8(continuation)) & 0xFFFF;
+    _set_char_starts(c, off + i, bits);
+    chars += __builtin_popcountll(bits);
+  }
+#endif
+  for (; i < len; i++) {
+    if ((text[i] & 0xC0) != 0x80) {
+      _set_char_starts(c, off + i, 1);
+      chars++;
+    }
+  }
+  return chars;
+}
+
+static int _buf_char_len(const struct text_queue *q) {
+  const struct text_chunk *c = q->first;
+  unsigned int off = q->first_off + 1;
+  while (off < c->used) {
+    uint64_t bits = c->starts[off / 64] >> (off % 64);
+    if (bits != 0) {
+      off += __builtin_ctzll(bits);
+      break;
+    }
+    off = (off | 63) + 1;
+  }
+  if (off > c->used) { off = c->used; }
+  return off - q->first_off;
+}
+
+//
+// Appends some text to a queue, starting new chunks as needed.
+// Returns how many characters got queued. If we run out of memory, whatever didn't fit gets dropped.
+//
+// The text needs to have been through _utf8_sanitize() first.
+//
+// Only call this with the queue claimed! This doesn't publish anything - that's up to the caller.
+//
+static int _text_queue_append(struct text_queue *q, const unsigned char *text, int len, int *bytes_queued) {
+  int chars = 0;
+  int i = 0;
+  while (i < len) {
+    // Fill the last chunk as far as we can without splitting a character.
+    int n = len - i;
+    int room = (q->last != NULL ? TEXT_CHUNK_BYTES - (int)q->last->used : 0);
+    if (n > room) {
+      n = room;
+      while (n > 0 && (text[i + n] & 0xC0) == 0x80) { n--; }
+    }
+
+    if (n == 0) {
+      struct text_chunk *c = _text_chunk_alloc(q);
+      if (c == NULL) { break; }
+      if (q->last == NULL) {
+        q->first = c;
+        q->first_off = 0;
+      } else {
+        q->last->next = c;
+      }
+      q->last = c;
+      continue;
+    }
+
+    memcpy(&q->last->bytes[q->last->used], &text[i], n);
+    chars += _mark_char_starts(q->last, q->last->used, &text[i], n);
+    q->last->used += n;
+    i += n;
+  }
+
+  *bytes_queued = i;
+  return chars;
+}
+
+//
+// Where the real *LookupString() puts its text before it gets queued.
+// If that's not UTF-8, it gets converted into convert_scratch first.
+// These grow when they need more room, and never shrink. Each thread gets its own.
+//
+static __thread char *lookup_scratch = NULL;
+static __thread int lookup_scratch_size = 0;
+static __thread char *convert_scratch = NULL;
+static __thread int convert_scratch_size = 0;
+
+static Bool _grow_scratch(char **scratch, int *scratch_size, int size) {
+  if (size <= *scratch_size) { return True; }
+  char *bigger = realloc(*scratch, size);
+  if (bigger == NULL) { return False; }
+  *scratch = bigger;
+  *scratch_size = size;
+  return True;
+}
+
+static Bool _grow_lookup_scratch(int size) {
+  return _grow_scratch(&lookup_scratch, &lookup_scratch_size, size);
+}
+
+//
+// Whether XmbLookupString() is just Xutf8LookupString() in disguise.
+// Asking the C library every call is slow, so we work it out once. XOpenIM() sets the locale, so it works it out again.
+//
+static int locale_is_utf8 = -1;
+
+static Bool _locale_is_utf8(void) {
+  int is_utf8 = ATOMIC_LOAD(&locale_is_utf8);
+  if (is_utf8 < 0) {
+    is_utf8 = (strcmp(nl_langinfo(CODESET), "UTF-8") == 0);
+    ATOMIC_STORE(&locale_is_utf8, is_utf8);
+  }
+  return is_utf8;
+}
+
+//
+// Converting to and from code points.
+// This assumes wchar_t holds Unicode code points, which glibc promises (__STDC_ISO_10646__).
+//
+static int _utf8_encode(uint32_t cp, unsigned char *out) {
+  if ((cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) { cp = '?'; }
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xC0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xE0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3F);
+    out[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  } else {
+    out[0] = 0xF0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3F);
+    out[2] = 0x80 | ((cp >> 6) & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+  }
+}
+
+// Only for text which has been through _utf8_sanitize()!
+static uint32_t _utf8_decode(const unsigned char *s, int len) {
+  if (len == 1) { return s[0]; }
+  uint32_t cp = s[0] & (0x7F >> len);
+  for (int i = 1; i < len; i++) {
+    cp = (cp << 6) | (s[i] & 0x3F);
+  }
+  return cp;
+}
+
+//
+// Turns whatever the real *LookupString() gave us into UTF-8, ready for _utf8_sanitize() and queueing.
+// Returns how many bytes that came to, or -1 if we ran out of memory.
+//
+static int _decode_lookup(enum lookup_encoding encoding, int len, const unsigned char **text_return) {
+  if (encoding == LOOKUP_UTF8 || (encoding == LOOKUP_MB && _locale_is_utf8())) {
+    *text_return = (const unsigned char *)lookup_scratch;
+    return len;
+  }
+
+  // Nothing turns into more than 4 bytes of UTF-8.
+  if (!_grow_scratch(&convert_scratch, &convert_scratch_size, len * 4)) { return -1; }
+  unsigned char *out = (unsigned char *)convert_scratch;
+  int out_len = 0;
+
+  if (encoding == LOOKUP_WC) {
+    const wchar_t *in = (const wchar_t *)lookup_scratch;
+    for (int i = 0; i < len; i++) {
+      out_len += _utf8_encode((uint32_t)in[i], &out[out_len]);
+    }
+  } else {
+    mbstate_t mbs;
+    memset(&mbs, 0, sizeof(mbs));
+    int i = 0;
+    while (i < len) {
+      wchar_t wc;
+      size_t used = mbrtowc(&wc, &lookup_scratch[i], len - i, &mbs);
+      if (used == (size_t)-1 || used == (size_t)-2) {
+        // Broken or cut short. Skip a byte and start afresh.
+        memset(&mbs, 0, sizeof(mbs));
+        wc = '?';
+        used = 1;
+      } else if (used == 0) {
+        used = 1;
+      }
+      out_len += _utf8_encode((uint32_t)wc, &out[out_len]);
+      i += used;
+    }
+  }
+
+  *text_return = out;
+  return out_len;
+}
+
+//
+// Puts the character at the head of a queue into the caller's buffer, in the form they asked for.
+// Returns how many units that took up - if that's more than buffer_len, nothing got written.
+//
+static int _encode_char(enum lookup_encoding encoding, const unsigned char *c, int len, void *buffer_return, int buffer_len) {
+  if (encoding == LOOKUP_UTF8 || (encoding == LOOKUP_MB && _locale_is_utf8())) {
+    if (len <= buffer_len) { memcpy(buffer_return, c, len); }
+    return len;
+  }
+
+  uint32_t cp = _utf8_decode(c, len);
+  if (encoding == LOOKUP_WC) {
+    if (buffer_len >= 1) { *(wchar_t *)buffer_return = (wchar_t)cp; }
+    return 1;
+  }
+
+  char mb[MB_LEN_MAX];
+  mbstate_t mbs;
+  memset(&mbs, 0, sizeof(mbs));
+  size_t mb_len = wcrtomb(mb, (wchar_t)cp, &mbs);
+  if (mb_len == (size_t)-1) {
+    // The locale can't say this one.
+    mb[0] = '?';
+    mb_len = 1;
+  }
+  if ((int)mb_len <= buffer_len) { memcpy(buffer_return, mb, mb_len); }
+  return mb_len;
+}
+
+//
+// With FORCEIME_ASYNC_IM, the program's ICs start out on a local IM, and get a twin on the real IM server once it turns up.
+// (See XOpenIM() below.) This is where we keep track of which is which.
+//
+// Anything which talks to the IM about one of the program's ICs goes to its twin instead, once it has one.
+// Looking a twin up doesn't take a lock - server_ic is set last and cleared first.
+//
+#define MAX_IC_BINDINGS 32
+struct ic_binding {
+  XIC app_ic;
+  XIM app_im;
+  Window client_window;
+  Window focus_window;
+  Bool focused;
+  XIC server_ic;
+};
+static struct ic_binding ic_bindings[MAX_IC_BINDINGS];
+static int ic_bindings_used = 0;
+static pthread_mutex_t ic_bindings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static XIC _bound_ic(XIC ic) {
+  if (ATOMIC_LOAD(&ic_bindings_used) == 0) { return ic; }
+  for (int i = 0; i < MAX_IC_BINDINGS; i++) {
+    if (ic_bindings[i].app_ic == ic) {
+      XIC server_ic = ATOMIC_LOAD(&ic_bindings[i].server_ic);
+      return (server_ic != NULL ? server_ic : ic);
+    }
+  }
+  return ic;
+}
+
+// Only call this with ic_bindings_lock held!
+static struct ic_binding *_ic_binding_find(XIC ic) {
+  for (int i = 0; i < MAX_IC_BINDINGS; i++) {
+    if (ic_bindings[i].app_ic != NULL && ic_bindings[i].app_ic == ic) {
+      return &ic_bindings[i];
+    }
+  }
+  return NULL;
+}
+
+//
+// We wouldn't normally need to intercept Xutf8LookupString(), but Unity is a poorly-written piece of software.
+// So, when the real function inevitably returns multiple UTF-8 characters, we have to do return one at a time.
+// We also need to cooperate with our XNextEvent() shim so that said shim can report more events.
+//
+// buffer_len is in bytes for LOOKUP_UTF8 and LOOKUP_MB, and wchar_ts for LOOKUP_WC.
+//
+static int _shim_lookup_string(enum lookup_encoding encoding, XIC ic, XKeyPressedEvent *event, void *buffer_return, int buffer_len, KeySym *keysym_return, Status *status_return)
+{
+  // The IM only knows about the IC it made, which might not be the program's one.
+  XIC real_ic = _bound_ic(ic);
+
+  // If every window has text queued, or another thread is busy with this window's queue,
+  // just pass this one through as-is.
+  struct ime_state *st = NULL;
+  struct text_queue *q = _claim_window_queue(event->display, event->window, True, &st);
+  if (q == NULL) {
+    return _real_lookup_string(encoding, real_ic, event, buffer_return, buffer_len, keysym_return, status_return);
+  }
+  st->ic = ic;
+  if (event->keycode != None) {
+    // This is a real KeyPress, even if it didn't come through our XNextEvent().
+    XEvent key_event;
+    key_event.xkey = *event;
+    _set_last_key_event(q, &key_event);
+  }
+
+  // We always need a status, even if the caller doesn't want one.
+  Status status_dummy;
+  if (status_return == NULL) { status_return = &status_dummy; }
+
+  if (_text_string_used(q) == 0) {
+    int unit_size = lookup_unit_size[encoding];
+    int added = 0;
+    if (_grow_lookup_scratch(lookup_bytes_in)) {
+      added = _real_lookup_string(encoding, real_ic, event, lookup_scratch, lookup_scratch_size / unit_size, keysym_return, status_return);
+      if (*status_return == XBufferOverflow) {
+        // The IM has more than we asked for, and has told us how much. Ask again with enough room.
+        if (_grow_lookup_scratch(added * unit_size)) {
+          added = _real_lookup_string(encoding, real_ic, event, lookup_scratch, lookup_scratch_size / unit_size, keysym_return, status_return);
+        }
+        if (*status_return == XBufferOverflow) {
+          LOG(LOG_ERROR, "ForceIMESupport: *LookupString overflowed even after asking for %.0s%lld units!\n", NULL, added, 0);
+          LIVE_COUNT(im_overflows);
+          PROBE(im_overflow, event->type, added);
+          added = 0;
+          *status_return = XLookupNone;
+        }
+      }
+    }
+    const unsigned char *text = NULL;
+    if (added > 0) {
+      int decoded = _decode_lookup(encoding, added, &text);
+      if (decoded < 0) {
+        LOG(LOG_ERROR, "ForceIMESupport: out of memory converting text, dropped it\n", NULL, 0, 0);
+        LIVE_ADD(bytes_dropped, added * unit_size);
+      }
+      added = decoded;
+    }
+
+    if (added > 0) {
+      int replaced = _utf8_sanitize((unsigned char *)text, added);
+      if (replaced > 0) {
+        LOG(LOG_WARN, "ForceIMESupport: IM gave us %.0s%lld bytes of broken UTF-8, replaced them with '?'\n", NULL, replaced, 0);
+      }
+
+      // Count the characters now, so XPending() and friends don't have to.
+      int bytes_queued = 0;
+      int chars = _text_queue_append(q, text, added, &bytes_queued);
+      if (bytes_queued < added) {
+        LOG(LOG_ERROR, "ForceIMESupport: out of memory queueing text, dropped %.0s%lld of %lld bytes\n", NULL, added - bytes_queued, added);
+        LIVE_ADD(bytes_dropped, added - bytes_queued);
+      }
+      if (bytes_queued > 0) {
+        STATS_RECORD(&queue_depth_hist, _pending_chars(event->display, NULL));
+        q->queued_ns = _now_ns();
+        ATOMIC_STORE(&q->chars, q->chars + chars);
+        LIVE_ADD(chars_queued, chars);
+        _queue_depth_change(chars);
+        PROBE(enqueue, event->type, chars);
+        ATOMIC_STORE(&q->tail, q->tail + bytes_queued);
+        __atomic_add_fetch(&queues_with_text, 1, __ATOMIC_RELEASE);
+      }
+    }
+  } else {
+    // We're handing out what we already have.
+    *status_return = XLookupChars;
+  }
+
+  int shimmed_result = 0;
+  if (_text_string_used(q) >= 1) {
+    int bytes_to_grab = _buf_char_len(q);
+
+    // SANITY CHECK: Make sure this doesn't actually overflow!
+    if (bytes_to_grab > (int)(q->first->used - q->first_off)) {
+      bytes_to_grab = q->first->used - q->first_off;
+    }
+
+    // Copy this across, if it fits. If it doesn't, the caller gets told how much room it needs, and it stays queued.
+    shimmed_result = _encode_char(encoding, &q->first->bytes[q->first_off], bytes_to_grab, buffer_return, buffer_len);
+    if (shimmed_result > buffer_len) {
+      *status_return = XBufferOverflow;
+      LIVE_COUNT(caller_overflows);
+      PROBE(overflow, event->type, shimmed_result);
+      _queue_unclaim(q);
+      return shimmed_result;
+    }
+    STATS_RECORD(&char_latency_hist, _now_ns() - q->queued_ns);
+    LIVE_COUNT(chars_delivered);
+    _queue_depth_change(-1);
+    PROBE(dequeue, event->type, bytes_to_grab);
+
+    // Move along - no need to shuffle anything around
+    q->first_off += bytes_to_grab;
+    if (q->first_off >= q->first->used) {
+      struct text_chunk *done = q->first;
+      q->first = done->next;
+      q->first_off = 0;
+      if (q->first == NULL) { q->last = NULL; }
+      done->next = q->spare;
+      q->spare = done;
+    }
+    if (bytes_to_grab == _text_string_used(q)) {
+      ATOMIC_STORE(&q->chars, 0);
+      ATOMIC_STORE(&q->head, q->head + bytes_to_grab);
+      __atomic_sub_fetch(&queues_with_text, 1, __ATOMIC_RELEASE);
+    } else {
+      ATOMIC_STORE(&q->chars, q->chars - 1);
+      ATOMIC_STORE(&q->head, q->head + bytes_to_grab);
+    }
+  }
+
+  _queue_unclaim(q);
+  return shimmed_result;
+}
+
+static int _shim_Xutf8LookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return)
+{
+  return _shim_lookup_string(LOOKUP_UTF8, ic, event, buffer_return, bytes_buffer, keysym_return, status_return);
+}
+
+static int _shim_XmbLookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return)
+{
+  return _shim_lookup_string(LOOKUP_MB, ic, event, buffer_return, bytes_buffer, keysym_return, status_return);
+}
+
+static int _shim_XwcLookupString(XIC ic, XKeyPressedEvent *event, wchar_t *buffer_return, int wchars_buffer, KeySym *keysym_return, Status *status_return)
+{
+  return _shim_lookup_string(LOOKUP_WC, ic, event, buffer_return, wchars_buffer, keysym_return, status_return);
+}
+
+static int _traced_lookup_string(enum lookup_encoding encoding, XIC ic, XKeyPressedEvent *event, void *buffer_return, int buffer_len, KeySym *keysym_return, Status *status_return)
+{
+  Status status_dummy;
+  if (status_return == NULL) { status_return = &status_dummy; }
+  uint64_t t0 = _now_ns();
+  int result = _shim_lookup_string(encoding, ic, event, buffer_return, buffer_len, keysym_return, status_return);
+  _trace_lookup(FORCEIME_TRACE_CALL, encoding, t0, ic, result, event, buffer_return, status_return);
+  return result;
+}
+
+static int _traced_Xutf8LookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return)
+{
+  return _traced_lookup_string(LOOKUP_UTF8, ic, event, buffer_return, bytes_buffer, keysym_return, status_return);
+}
+
+static int _traced_XmbLookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return)
+{
+  return _traced_lookup_string(LOOKUP_MB, ic, event, buffer_return, bytes_buffer, keysym_return, status_return);
+}
+
+static int _traced_XwcLookupString(XIC ic, XKeyPressedEvent *event, wchar_t *buffer_return, int wchars_buffer, KeySym *keysym_return, Status *status_return)
+{
+  return _traced_lookup_string(LOOKUP_WC, ic, event, buffer_return, wchars_buffer, keysym_return, status_return);
+}
+
+//
+// XOpenIM needs some things done to the environment before it is called.
+// The locale only needs setting up once, though, no matter how many times the program opens an IM.
+//
+static pthread_once_t locale_once = PTHREAD_ONCE_INIT;
+static Bool locale_ok = False;
+
+static void _setup_locale(void) {
+  // For the IME to work, we need to set a valid locale and valid locale modifiers.
+  if (setlocale(LC_ALL, "") != NULL) {
+    ATOMIC_STORE(&locale_is_utf8, -1);
+    if (real.XSupportsLocale()) {
+      (void)real.XSetLocaleModifiers("");
+      locale_ok = True;
+    }
+  }
+}
+
+//
+// Opening an IM means waiting on the IM server. If ibus or fcitx is slow, or hasn't started yet, the program just sits there.
+//
+// With FORCEIME_ASYNC_IM=1, we don't wait:
+// - XOpenIM() opens a local IM (@im=none) instead, which doesn't need a server, and hands that back straight away.
+//   The program's ICs get made on that, so it has something to work with. It just won't get any IME text yet.
+// - We ask Xlib to tell us when the real IM server is ready (XRegisterIMInstantiateCallback()).
+//   Xlib checks for that while the program reads events, so it doesn't hold anything up either.
+// - When it's ready, we open it, and give each of the program's ICs a twin on it (see ic_bindings).
+//   Focus moves across to the twin, and from then on the program is talking to the real IM server without knowing it.
+// - If the IM server goes away, the twins go with it and we fall back to the local ICs until it comes back.
+//
+#define MAX_ASYNC_IMS 4
+struct async_im {
+  Display *display;
+  XIM local_im;
+  XIM server_im;
+  XrmDatabase db;
+  char *res_name;
+  char *res_class;
+  XIMCallback destroy_callback;
+};
+static struct async_im async_ims[MAX_ASYNC_IMS];
+
+// Only call this with ic_bindings_lock held!
+static void _bind_server_ic(struct async_im *a, struct ic_binding *b) {
+  uint64_t t0 = _im_clock();
+  XIC server_ic = real.XCreateIC(a->server_im,
+    XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
+    XNClientWindow, b->client_window,
+    XNFocusWindow, (b->focus_window != 0 ? b->focus_window : b->client_window),
+    NULL);
+  _im_round_trip(NULL, t0);
+  if (server_ic == NULL) {
+    LOG(LOG_WARN, "ForceIMESupport: could not make a server IC for %.0s0x%llx, staying local\n", NULL, (uintptr_t)b->app_ic, 0);
+    return;
+  }
+  ATOMIC_STORE(&b->server_ic, server_ic);
+  if (b->focused) {
+    real.XUnsetICFocus(b->app_ic);
+    real.XSetICFocus(server_ic);
+  }
+}
+
+static void _server_im_destroyed(XIM im, XPointer client_data, XPointer call_data) {
+  (void)im;
+  (void)call_data;
+  struct async_im *a = (struct async_im *)client_data;
+  LOG(LOG_WARN, "ForceIMESupport: IM server went away, falling back to the local IM\n", NULL, 0, 0);
+
+  if (threaded) { pthread_mutex_lock(&ic_bindings_lock); }
+  for (int i = 0; i < MAX_IC_BINDINGS; i++) {
+    struct ic_binding *b = &ic_bindings[i];
+    if (b->app_ic != NULL && b->app_im == a->local_im && b->server_ic != NULL) {
+      // The server IC went with the server, so there's nothing to destroy.
+      ATOMIC_STORE(&b->server_ic, NULL);
+      if (b->focused) { real.XSetICFocus(b->app_ic); }
+    }
+  }
+  a->server_im = NULL;
+  if (threaded) { pthread_mutex_unlock(&ic_bindings_lock); }
+}
+
+static void _server_im_ready(Display *display, XPointer client_data, XPointer call_data) {
+  (void)call_data;
+  struct async_im *a = (struct async_im *)client_data;
+  if (a->local_im == NULL || a->server_im != NULL) { return; }
+
+  XIM server_im = real.XOpenIM(display, a->db, a->res_name, a->res_class);
+  if (server_im == NULL) {
+    LOG(LOG_WARN, "ForceIMESupport: IM server said it was ready, but we couldn't open it\n", NULL, 0, 0);
+    return;
+  }
+  a->destroy_callback.client_data = (XPointer)a;
+  a->destroy_callback.callback = _server_im_destroyed;
+  (void)real.XSetIMValues(server_im, XNDestroyCallback, &a->destroy_callback, NULL);
+
+  if (threaded) { pthread_mutex_lock(&ic_bindings_lock); }
+  a->server_im = server_im;
+  for (int i = 0; i < MAX_IC_BINDINGS; i++) {
+    struct ic_binding *b = &ic_bindings[i];
+    if (b->app_ic != NULL && b->app_im == a->local_im && b->server_ic == NULL) {
+      _bind_server_ic(a, b);
+    }
+  }
+  if (threaded) { pthread_mutex_unlock(&ic_bindings_lock); }
+  LOG(LOG_INFO, "ForceIMESupport: IM server is ready, switched over to it\n", NULL, 0, 0);
+}
+
+static struct async_im *_async_im_find(XIM im) {
+  for (int i = 0; i < MAX_ASYNC_IMS; i++) {
+    if (async_ims[i].local_im != NULL && async_ims[i].local_im == im) {
+      return &async_ims[i];
+    }
+  }
+  return NULL;
+}
+
+static XIM _open_async_im(Display *display, XrmDatabase db, char *res_name, char *res_class) {
+  // Grab a slot first. The callback can fire before XRegisterIMInstantiateCallback() even returns, so don't hold the lock over that.
+  struct async_im *a = NULL;
+  if (threaded) { pthread_mutex_lock(&ic_bindings_lock); }
+  for (int i = 0; i < MAX_ASYNC_IMS; i++) {
+    if (async_ims[i].display == NULL) {
+      a = &async_ims[i];
+      a->display = display;
+      break;
+    }
+  }
+  if (threaded) { pthread_mutex_unlock(&ic_bindings_lock); }
+  if (a == NULL) { return NULL; }
+
+  (void)real.XSetLocaleModifiers("@im=none");
+  XIM local_im = real.XOpenIM(display, db, res_name, res_class);
+  (void)real.XSetLocaleModifiers("");
+  if (local_im == NULL) {
+    a->display = NULL;
+    return NULL;
+  }
+
+  a->server_im = NULL;
+  a->db = db;
+  a->res_name = (res_name != NULL ? strdup(res_name) : NULL);
+  a->res_class = (res_class != NULL ? strdup(res_class) : NULL);
+  ATOMIC_STORE(&a->local_im, local_im);
+  if (!real.XRegisterIMInstantiateCallback(display, db, a->res_name, a->res_class, _server_im_ready, (XPointer)a)) {
+    LOG(LOG_WARN, "ForceIMESupport: could not wait for the IM server, staying on the local IM\n", NULL, 0, 0);
+  }
+  LOG(LOG_INFO, "shimmed XOpenIM! (local IM for now)\n", NULL, 0, 0);
+  return local_im;
+}
+
+//
+// Stops waiting for the IM server, and unbinds all the twins.
+// With close_server set, the IM server's side gets closed too. Without it, we just forget about it, because the Display is going away.
+//
+static void _async_im_release(struct async_im *a, Bool close_server) {
+  real.XUnregisterIMInstantiateCallback(a->display, a->db, a->res_name, a->res_class, _server_im_ready, (XPointer)a);
+  if (threaded) { pthread_mutex_lock(&ic_bindings_lock); }
+  for (int i = 0; i < MAX_IC_BINDINGS; i++) {
+    struct ic_binding *b = &ic_bindings[i];
+    if (b->app_ic != NULL && b->app_im == a->local_im && b->server_ic != NULL) {
+      if (close_server) { real.XDestroyIC(b->server_ic); }
+      ATOMIC_STORE(&b->server_ic, NULL);
+    }
+  }
+  XIM server_im = a->server_im;
+  a->server_im = NULL;
+  ATOMIC_STORE(&a->local_im, NULL);
+  if (threaded) { pthread_mutex_unlock(&ic_bindings_lock); }
+  if (close_server && server_im != NULL) { real.XCloseIM(server_im); }
+  free(a->res_name);
+  free(a->res_class);
+  a->res_name = NULL;
+  a->res_class = NULL;
+  a->display = NULL;
+}
+
+static XIM _shim_XOpenIM(Display *display, XrmDatabase db, char *res_name, char *res_class) {
+  pthread_once(&locale_once, _setup_locale);
+
+  if (async_im_mode && locale_ok) {
+    XIM result = _open_async_im(display, db, res_name, res_class);
+    if (result != NULL) { return result; }
+  }
+
+  XIM result = real.XOpenIM(display, db, res_name, res_class);
+  LOG(LOG_INFO, "shimmed XOpenIM!\n", NULL, 0, 0);
+  return result;
+}
+
+static XIM _traced_XOpenIM(Display *display, XrmDatabase db, char *res_name, char *res_class) {
+  uint64_t t0 = _now_ns();
+  XIM result = _shim_XOpenIM(display, db, res_name, res_class);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XOpenIM, t0, 0, (result != NULL), NULL, NULL, 0);
+  return result;
+}
+
+//
+// Keeping track of the program's ICs, and which twin goes with which. See above.
+//
+static void _ic_binding_add(XIM im, XIC ic, Window client_window, Window focus_window) {
+  struct async_im *a = _async_im_find(im);
+  if (a == NULL) { return; }
+
+  if (threaded) { pthread_mutex_lock(&ic_bindings_lock); }
+  struct ic_binding *b = NULL;
+  for (int i = 0; i < MAX_IC_BINDINGS; i++) {
+    if (ic_bindings[i].app_ic == NULL) {
+      b = &ic_bindings[i];
+      break;
+    }
+  }
+  if (b != NULL) {
+    b->app_im = im;
+    b->client_window = client_window;
+    b->focus_window = focus_window;
+    b->focused = False;
+    b->server_ic = NULL;
+    b->app_ic = ic;
+    ATOMIC_STORE(&ic_bindings_used, ic_bindings_used + 1);
+    if (a->server_im != NULL) { _bind_server_ic(a, b); }
+  } else {
+    LOG(LOG_WARN, "ForceIMESupport: too many ICs, 0x%.0s%llx stays on the local IM\n", NULL, (uintptr_t)ic, 0);
+  }
+  if (threaded) { pthread_mutex_unlock(&ic_bindings_lock); }
+}
+
+//
+// Really destroys an IC, and its twin if it has one.
+//
+static void _destroy_ic(XIC ic) {
+  if (ATOMIC_LOAD(&ic_bindings_used) > 0) {
+    if (threaded) { pthread_mutex_lock(&ic_bindings_lock); }
+    struct ic_binding *b = _ic_binding_find(ic);
+    if (b != NULL) {
+      XIC server_ic = b->server_ic;
+      ATOMIC_STORE(&b->server_ic, NULL);
+      b->app_ic = NULL;
+      ATOMIC_STORE(&ic_bindings_used, ic_bindings_used - 1);
+      if (server_ic != NULL) { real.XDestroyIC(server_ic); }
+    }
+    if (threaded) { pthread_mutex_unlock(&ic_bindings_lock); }
+  }
+  real.XDestroyIC(ic);
+}
+
+static void _set_ic_focus(XIC ic, Bool focus) {
+  if (ATOMIC_LOAD(&ic_bindings_used) > 0) {
+    if (threaded) { pthread_mutex_lock(&ic_bindings_lock); }
+    struct ic_binding *b = _ic_binding_find(ic);
+    if (b != NULL) { b->focused = focus; }
+    if (threaded) { pthread_mutex_unlock(&ic_bindings_lock); }
+  }
+
+  XIC target = _bound_ic(ic);
+  if (focus) {
+    real.XSetICFocus(target);
+  } else {
+    real.XUnsetICFocus(target);
+  }
+}
+
+static void _shim_XSetICFocus(XIC ic) {
+  _set_ic_focus(ic, True);
+}
+
+static void _shim_XUnsetICFocus(XIC ic) {
+  _set_ic_focus(ic, False);
+}
+
+//
+// SDL-based programs (Unity included) create a new IC whenever text input gets turned on, or focus moves around,
+// and destroy the old one. Each of those is a round trip or two to the IM server.
+//
+// So we keep ICs around instead. They're keyed by (XIM, client window, focus window, input style).
+// - XCreateIC() for a key we already have hands back the IC we already have, after pointing its focus window at the right place.
+// - XDestroyIC() doesn't destroy anything while someone else is still using the IC. Once nobody is, it gets "parked":
+//   we take its focus away so the IM stops sending it text, and keep it for the next XCreateIC().
+// - When the cache is full, the IC which has been parked the longest really does get destroyed.
+// - XCloseIM() and XCloseDisplay() destroy anything we've parked for them.
+//
+// FORCEIME_IC_CACHE sets how many ICs we keep. (Default: 8, maximum 16.) 0 turns this off.
+//
+struct ic_cache_entry {
+  XIM im;
+  Window client_window;
+  Window focus_window;
+  XIMStyle style;
+  XIC ic;
+  int refs;           // 0 means parked
+  uint64_t parked_seq;
+};
+static struct ic_cache_entry ic_cache[MAX_CACHED_ICS];
+static uint64_t ic_cache_seq = 0;
+static pthread_mutex_t ic_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Only call these with ic_cache_lock held!
+static struct ic_cache_entry *_ic_cache_find(XIM im, Window client_window, Window focus_window, XIMStyle style) {
+  for (int i = 0; i < ic_cache_size; i++) {
+    struct ic_cache_entry *e = &ic_cache[i];
+    if (e->ic != NULL && e->im == im && e->client_window == client_window && e->focus_window == focus_window && e->style == style) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static struct ic_cache_entry *_ic_cache_find_ic(XIC ic) {
+  for (int i = 0; i < ic_cache_size; i++) {
+    if (ic_cache[i].ic != NULL && ic_cache[i].ic == ic) {
+      return &ic_cache[i];
+    }
+  }
+  return NULL;
+}
+
+// Returns an empty slot, destroying the IC which has been parked the longest if it has to. NULL if everything is in use.
+static struct ic_cache_entry *_ic_cache_slot(void) {
+  struct ic_cache_entry *victim = NULL;
+  for (int i = 0; i < ic_cache_size; i++) {
+    struct ic_cache_entry *e = &ic_cache[i];
+    if (e->ic == NULL) { return e; }
+    if (e->refs == 0 && (victim == NULL || e->parked_seq < victim->parked_seq)) {
+      victim = e;
+    }
+  }
+  if (victim != NULL) {
+    LOG(LOG_DEBUG, "ForceIMESupport: IC cache full, destroying parked IC %.0s0x%llx\n", NULL, (uintptr_t)victim->ic, 0);
+    _destroy_ic(victim->ic);
+    victim->ic = NULL;
+  }
+  return victim;
+}
+
+//
+// Forgets everything cached for an IM, destroying whatever's parked. Live ICs are left for the program to destroy.
+//
+static void _ic_cache_drop(XIM im, Display *display) {
+  if (threaded) { pthread_mutex_lock(&ic_cache_lock); }
+  for (int i = 0; i < ic_cache_size; i++) {
+    struct ic_cache_entry *e = &ic_cache[i];
+    if (e->ic != NULL && (e->im == im || (display != NULL && real.XDisplayOfIM(e->im) == display))) {
+      if (e->refs == 0) { _destroy_ic(e->ic); }
+      e->ic = NULL;
+    }
+  }
+  if (threaded) { pthread_mutex_unlock(&ic_cache_lock); }
+}
+
+static Status _shim_XCloseIM(XIM im) {
+  _ic_cache_drop(im, NULL);
+
+  // If this was a stand-in for the real IM server, stop waiting for it, and close it if it turned up.
+  struct async_im *a = _async_im_find(im);
+  if (a != NULL) { _async_im_release(a, True); }
+
+  return real.XCloseIM(im);
+}
+
+//
+// XCreateIC is another place where we need to ensure certain things are set for an IME to work.
+//
+// XCreateIC takes a variable number of arguments.
+// Passing this along correctly is currently more trouble than it's worth.
+//
+// So instead, we're going to read what we can from here, and send only what we want...
+//
+// XNInputStyle:
+// Using XIMPreeditNothing | XIMStatusNothing, unless FORCEIME_INPUT_STYLE says otherwise.
+// Not to be confused with XIMPreeditNone | XIMStatusNone, which prevents the IME from working.
+// UPDATE: I accidentally said that Unity 2019 uses None. It uses Nothing instead, which is what we currently want.
+//
+// XNClientWindow:
+// A compulsory argument. We need to grab this from the program.
+//
+// XNFocusWindow:
+// If the program uses this argument explicitly, we need to grab it. Probably.
+//
+static XIC _create_ic(XIM im, XIMStyle program_style, Window client_window, Window focus_window);
+
+XIC XCreateIC(XIM im, ...) {
+  HOOK_ENTER(XCreateIC);
+  COUNT_CALL(XCreateIC);
+  PROBE(XCreateIC_entry, 0, 0);
+  LOG(LOG_INFO, "shimming XCreateIC and I want to cry\n", NULL, 0, 0);
+
+  XIMStyle program_style = 0;
+  Window client_window = 0;
+  Window focus_window = 0;
+  va_list ap;
+  va_start(ap, im);
+  for (;;) {
+    const char *k = va_arg(ap, const char *);
+    if (k == NULL) { break; } // End of list
+
+    if (!strcmp(k, XNInputStyle)) {
+      int v = va_arg(ap, int);
+      program_style = (XIMStyle)v;
+      LOG(LOG_INFO, "shimmed arg \"%s\": %lld\n", k, v, 0);
+    } else if (!strcmp(k, XNClientWindow)) {
+      Window v = va_arg(ap, Window);
+      client_window = v;
+      LOG(LOG_INFO, "captured arg \"%s\": %llu\n", k, v, 0);
+    } else if (!strcmp(k, XNFocusWindow)) {
+      Window v = va_arg(ap, Window);
+      focus_window = v;
+      LOG(LOG_INFO, "captured arg \"%s\": %llu\n", k, v, 0);
+    } else if (!strcmp(k, XNPreeditAttributes)) {
+      // TODO: If someone actually runs this in a program which supports preedit, we will probably want to at least not break things. --GM
+      XVaNestedList v = va_arg(ap, XVaNestedList);
+      LOG(LOG_INFO, "misc arg \"%s\": 0x%llx\n", k, (uintptr_t)v, 0);
+    } else {
+      void *v = va_arg(ap, void *);
+      LOG(LOG_INFO, "misc arg \"%s\": 0x%llx\n", k, (uintptr_t)v, 0);
+    }
+  }
+  va_end(ap);
+
+  uint64_t t0 = (trace != NULL ? _now_ns() : 0);
+  XIC result = _create_ic(im, program_style, client_window, focus_window);
+  if (trace != NULL) {
+    XEvent traced;
+    memset(&traced, 0, sizeof(traced));
+    traced.xany.window = client_window;
+    _trace_ic(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XCreateIC, t0, result, (int)program_style, (result != NULL), &traced, NULL, 0);
+  }
+  PROBE(XCreateIC_return, 0, (uintptr_t)result);
+  return result;
+}
+
+static XIC _create_ic(XIM im, XIMStyle program_style, Window client_window, Window focus_window) {
+  if (!HOOK_ENABLED(XCreateIC)) {
+    // Turned off with FORCEIME_DISABLE. We still can't pass the varargs on, so the program gets the parts we understood, as it asked for them.
+    uint64_t t0 = _im_clock();
+    XIC result = real.XCreateIC(im,
+      XNInputStyle, program_style,
+      XNClientWindow, client_window,
+      XNFocusWindow, focus_window,
+      NULL);
+    _im_round_trip(NULL, t0);
+    return result;
+  }
+
+  XIMStyle style = (forced_input_style != 0 ? forced_input_style : program_style);
+  if (style == 0) { style = XIMPreeditNothing | XIMStatusNothing; } // The program didn't say. It was supposed to.
+  if (threaded) { pthread_mutex_lock(&ic_cache_lock); }
+
+  struct ic_cache_entry *e = _ic_cache_find(im, client_window, focus_window, style);
+  if (e != NULL) {
+    // Parked ICs don't have a focus window any more, and a live one might have been moved. Either way, put it back.
+    if (focus_window != 0) {
+      (void)real.XSetICValues(e->ic, XNFocusWindow, focus_window, NULL);
+      XIC server_ic = _bound_ic(e->ic);
+      if (server_ic != e->ic) { (void)real.XSetICValues(server_ic, XNFocusWindow, focus_window, NULL); }
+    }
+    e->refs++;
+    XIC result = e->ic;
+    if (threaded) { pthread_mutex_unlock(&ic_cache_lock); }
+    LOG(LOG_INFO, "ForceIMESupport: reused cached IC %.0s0x%llx\n", NULL, (uintptr_t)result, 0);
+    return result;
+  }
+
+  uint64_t t0 = _im_clock();
+  XIC result = real.XCreateIC(im,
+    XNInputStyle, style,
+    XNClientWindow, client_window,
+    XNFocusWindow, focus_window,
+    NULL);
+  _im_round_trip(NULL, t0);
+  LOG(LOG_INFO, "shimmed XCreateIC!\n", NULL, 0, 0);
+  if (result != NULL) {
+    _ic_binding_add(im, result, client_window, focus_window);
+  }
+
+  if (result != NULL && ic_cache_size > 0) {
+    e = _ic_cache_slot();
+    if (e != NULL) {
+      e->im = im;
+      e->client_window = client_window;
+      e->focus_window = focus_window;
+      e->style = style;
+      e->ic = result;
+      e->refs = 1;
+    }
+  }
+
+  if (threaded) { pthread_mutex_unlock(&ic_cache_lock); }
+  return result;
+}
+
+//
+// We may need to force our fake events through the system.
+//
+static Bool _shim_XFilterEvent(XEvent *event, Window w) {
+  // Do not filter the fake events.
+  if (ATOMIC_LOAD(&queues_with_text) > 0 && event->type == KeyPress && event->xkey.keycode == None) {
+    // No need to claim the queue just to look at it. It does have to still be this window's, though.
+    struct ime_state *st = _ime_state_find(event->xkey.display, event->xkey.window);
+    struct text_queue *q = (st != NULL ? ATOMIC_LOAD(&st->queue) : NULL);
+    if (q != NULL && _queue_owned_by(q, event->xkey.display, event->xkey.window) && _text_string_used(q) > 0) {
+      return False;
+    }
+  }
+
+  return real.XFilterEvent(event, w);
+}
+
+static Bool _traced_XFilterEvent(XEvent *event, Window w) {
+  uint64_t t0 = _now_ns();
+  Bool result = _shim_XFilterEvent(event, w);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XFilterEvent, t0, 0, result, event, NULL, 0);
+  return result;
+}
+
+//
+// Working out where the program's frames are.
+//
+// Programs poll for events in a burst at the start of each frame, then go off and render it.
+// So if XPending() or XEventsQueued() hasn't been called for FRAME_GAP_NS, the next call starts a new frame.
+// Some programs never stop polling, so a frame also ends once it's gone on for as long as frames usually do.
+// That way pacing can never get stuck waiting for a frame that doesn't end.
+//
+// The frame length is a moving average, so one slow frame doesn't throw it out.
+//
+#define FRAME_GAP_NS 2000000
+#define MAX_FRAME_NS 1000000000 // Anything longer than this is the program sitting idle, not a frame
+#define DEFAULT_FRAME_NS 16666667 // Until we know better
+
+static void _note_poll(void) {
+  uint64_t now = _now_ns();
+  uint64_t last = pacing.last_poll_ns;
+  uint64_t frame_ns = __atomic_load_n(&pacing.frame_ns, __ATOMIC_RELAXED);
+  uint64_t since_start = now - pacing.frame_start_ns;
+  pacing.last_poll_ns = now;
+  if (last != 0 && now - last < FRAME_GAP_NS && since_start < (frame_ns != 0 ? frame_ns : DEFAULT_FRAME_NS)) { return; }
+
+#ifdef FORCEIME_PROFILE
+  _profile_end_frame(pacing.frame_start_ns != 0 && since_start < MAX_FRAME_NS ? since_start : 0);
+#endif
+  if (pacing.frame_start_ns != 0 && since_start < MAX_FRAME_NS) {
+    STATS_RECORD(&frame_interval_hist, since_start);
+    frame_ns = (frame_ns == 0 ? since_start : frame_ns - frame_ns / 8 + since_start / 8);
+    __atomic_store_n(&pacing.frame_ns, frame_ns, __ATOMIC_RELAXED);
+  }
+  pacing.frame_start_ns = now;
+  pacing.delivered = 0;
+  __atomic_store_n(&pacing.burst, -1, __ATOMIC_RELAXED);
+}
+
+//
+// How many synthetic events to tell the program about, when a Display has this many characters queued.
+// queued_ns is when they turned up.
+//
+static int _announced_chars(int chars, uint64_t queued_ns) {
+  if (delivery_mode == DELIVERY_BURST) { return chars; }
+  if (delivery_mode != DELIVERY_PACED) { return 1; }
+
+  int burst = __atomic_load_n(&pacing.burst, __ATOMIC_RELAXED);
+  if (burst < 0) {
+    // Just enough per frame to get through what's queued by the time it's been waiting for the target latency.
+    uint64_t frame_ns = __atomic_load_n(&pacing.frame_ns, __ATOMIC_RELAXED);
+    if (frame_ns == 0) { frame_ns = DEFAULT_FRAME_NS; }
+    uint64_t deadline_ns = queued_ns + target_latency_ns;
+    uint64_t now = _now_ns();
+    // This frame counts, plus however many more start before the deadline.
+    uint64_t frames = 1 + (deadline_ns > now ? (deadline_ns - now) / frame_ns : 0);
+    if (frames <= 1) {
+      burst = chars;
+    } else {
+      burst = (int)((chars + frames - 1) / frames);
+    }
+    __atomic_store_n(&pacing.burst, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&pacing.last_burst, burst, __ATOMIC_RELAXED);
+    STATS_RECORD(&paced_burst_hist, burst);
+  }
+  int left = burst - __atomic_load_n(&pacing.delivered, __ATOMIC_RELAXED);
+  if (left > chars) { left = chars; }
+  return (left > 0 ? left : 0);
+}
+
+//
+// _shim_XPending() and _shim_XEventsQueued() keep track of frames, for DELIVERY_PACED and the stats.
+// When nothing wants to know about frames, _select_hooks() picks the _untimed_ versions instead, which don't read the clock on every poll.
+//
+static inline __attribute__((always_inline)) int _pending(Display *display) {
+  // Announce our fake events.
+  // Only DELIVERY_PACED cares when the text turned up.
+  uint64_t queued_ns = 0;
+  int chars = _pending_chars(display, (delivery_mode == DELIVERY_PACED ? &queued_ns : NULL));
+  int announced = (chars > 0 ? _announced_chars(chars, queued_ns) : 0);
+  int staged = _staged_count(display);
+  if (announced > 0 || staged > 0) {
+    if (delivery_mode != DELIVERY_SINGLE) {
+      // Count what's already in Xlib's queue too, but don't go poking the socket for more.
+      return announced + staged + real.XEventsQueued(display, QueuedAlready);
+    }
+    return True;
+  }
+
+  return real.XPending(display);
+}
+
+static int _shim_XPending(Display *display) {
+  _check_stats_dump();
+  _note_poll();
+  return _pending(display);
+}
+
+static int _untimed_XPending(Display *display) {
+  return _pending(display);
+}
+
+static int _traced_XPending(Display *display) {
+  uint64_t t0 = _now_ns();
+  int result = _shim_XPending(display);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XPending, t0, 0, result, NULL, NULL, 0);
+  return result;
+}
+
+static inline __attribute__((always_inline)) int _events_queued(Display *display, int mode) {
+  // Announce our fake events.
+  int result = real.XEventsQueued(display, mode) + _staged_count(display);
+  uint64_t queued_ns = 0;
+  int chars = _pending_chars(display, (delivery_mode == DELIVERY_PACED ? &queued_ns : NULL));
+  if (chars > 0) {
+    return result + _announced_chars(chars, queued_ns);
+  }
+  return result;
+}
+
+static int _shim_XEventsQueued(Display *display, int mode) {
+  _note_poll();
+  return _events_queued(display, mode);
+}
+
+static int _untimed_XEventsQueued(Display *display, int mode) {
+  return _events_queued(display, mode);
+}
+
+static int _traced_XEventsQueued(Display *display, int mode) {
+  uint64_t t0 = _now_ns();
+  int result = _shim_XEventsQueued(display, mode);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XEventsQueued, t0, mode, result, NULL, NULL, 0);
+  return result;
+}
+
+//
+// These real events get delivered ahead of any synthetic KeyPress events, in this order.
+// - KeyRelease: otherwise keys look like they're being held down for ages.
+// - FocusOut: otherwise we keep typing into a window that isn't focused any more.
+// - ConfigureNotify, ClientMessage: resizes and window manager requests (e.g. closing the window) shouldn't wait on text.
+//
+static const int priority_event_types[] = {
+  KeyRelease,
+  FocusOut,
+  ConfigureNotify,
+  ClientMessage,
+};
+
+//
+// Picks a real event to deliver ahead of the queued text, if one deserves it.
+// Returns True and fills in event_return if so.
+//
+// q->synthetic_streak is how many synthetic events we've handed out since the last real one.
+//
+static Bool _schedule_real_event(Display *display, struct text_queue *q, XEvent *event_return) {
+  // This doesn't touch the socket, so it's cheap enough to do for every synthetic event.
+  if (real.XEventsQueued(display, QueuedAlready) > 0) {
+    for (size_t i = 0; i < sizeof(priority_event_types) / sizeof(priority_event_types[0]); i++) {
+      if (real.XCheckTypedEvent(display, priority_event_types[i], event_return)) {
+        return True;
+      }
+    }
+  }
+
+  // Is something else waiting for too long?
+  if (ATOMIC_LOAD(&q->synthetic_streak) >= max_real_lag && real.XEventsQueued(display, QueuedAfterReading) > 0) {
+    real.XNextEvent(display, event_return);
+    return True;
+  }
+
+  return False;
+}
+
+//
+// Remember the last real KeyPress for each window, so we have something to base our synthetic events on.
+//
+static void _saw_real_event(XEvent *event) {
+  LIVE_COUNT(real_events);
+  if (event->type == KeyPress) {
+    // If someone else has the queue, they can keep their KeyPress. This is only a template.
+    struct text_queue *q = _claim_window_queue(event->xkey.display, event->xkey.window, True, NULL);
+    if (q != NULL) {
+      _set_last_key_event(q, event);
+      ATOMIC_STORE(&q->synthetic_streak, 0);
+      _queue_unclaim(q);
+    }
+  }
+}
+
+//
+// Programs don't only read events with XNextEvent(). They peek at them, search for them by type, window or mask,
+// or hand Xlib a predicate to search with. All of those need to see the same events that XNextEvent() would,
+// or a program which saw XPending() say True can end up waiting on the socket for an event that only we have.
+//
+// So, as far as every one of those is concerned, each Display's events go:
+// - the real event the scheduler picked to go next, if there is one (the "staged" event)
+// - one synthetic KeyPress, if there's text queued
+// - whatever Xlib has
+//
+// Once _schedule_real_event() has picked a real event, we have to hold on to it until someone takes it.
+// Otherwise XPeekEvent() could show one event and XNextEvent() could hand out another.
+// The staged event lives in the queue it jumped ahead of. Nobody but Xlib should be taking events out from under us,
+// but if the queue goes away first, the event gets put back with XPutBackEvent().
+//
+// Staging only happens when a real event jumps the queue, so this just borrows ime_states_lock rather than having its own.
+//
+static void _stage_event(Display *display, struct text_queue *q, XEvent *event) {
+  if (threaded) { pthread_mutex_lock(&ime_states_lock); }
+  if (q->has_staged || ATOMIC_LOAD(&q->display) != display) {
+    // Another thread got in first, or the queue's gone to someone else. Ours goes back to the front of Xlib's queue instead.
+    real.XPutBackEvent(display, event);
+  } else {
+    q->staged_event = *event;
+    ATOMIC_STORE(&q->has_staged, True);
+    __atomic_add_fetch(&staged_events, 1, __ATOMIC_RELEASE);
+  }
+  if (threaded) { pthread_mutex_unlock(&ime_states_lock); }
+}
+
+//
+// Copies the staged event out, if there is one.
+// If predicate is set, it only counts if that says so. If remove is set, it's also taken.
+//
+static Bool _unstage_event(Display *display, struct text_queue *q, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg, XEvent *event_return, Bool remove) {
+  Bool found = False;
+  if (threaded) { pthread_mutex_lock(&ime_states_lock); }
+  if (q->has_staged) {
+    *event_return = q->staged_event;
+    found = (predicate == NULL || predicate(display, event_return, arg));
+    if (found && remove) {
+      ATOMIC_STORE(&q->has_staged, False);
+      __atomic_sub_fetch(&staged_events, 1, __ATOMIC_RELEASE);
+    }
+  }
+  if (threaded) { pthread_mutex_unlock(&ime_states_lock); }
+
+  if (found && remove) {
+    ATOMIC_STORE(&q->synthetic_streak, 0);
+    _saw_real_event(event_return);
+  }
+  return found;
+}
+
+static void _synthetic_event(struct text_queue *q, XEvent *event_return) {
+  _get_last_key_event(q, event_return);
+  event_return->xkey.type = KeyPress;
+  event_return->xkey.keycode = None;
+}
+
+//
+// Looks for one of our events (staged or synthetic) on this Display, in the order above.
+// Returns False if the caller should go on to look at what Xlib has.
+//
+static Bool _merged_event(Display *display, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg, XEvent *event_return, Bool remove) {
+  struct text_queue *q = _staged_queue(display);
+  if (q == NULL) {
+    q = _pending_queue(display);
+    if (q == NULL) { return False; }
+
+    // Real events still get a fair go.
+    XEvent real_event;
+    if (_schedule_real_event(display, q, &real_event)) {
+      _stage_event(display, q, &real_event);
+    }
+  }
+
+  if (_unstage_event(display, q, predicate, arg, event_return, remove)) { return True; }
+
+  // If we have more characters to pass through,
+  // synthesise some KeyPress events in order to pass them through.
+  if (_text_string_used(q) == 0) { return False; }
+  _synthetic_event(q, event_return);
+  if (predicate != NULL && !predicate(display, event_return, arg)) { return False; }
+  if (remove) {
+    LIVE_COUNT(synthetic_events);
+    PROBE(synthetic, KeyPress, ATOMIC_LOAD(&q->chars));
+    __atomic_add_fetch(&q->synthetic_streak, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pacing.delivered, 1, __ATOMIC_RELAXED);
+  }
+  return True;
+}
+
+//
+// Any event which comes out of XNextEvent() *MUST* be fed through XFilterEvent()!
+// So, that's what we do...
+// ... unless we need to tell the program that there's still more text to accept.
+//
+static int last_next_event_result = 0; // FIXME: The return value of this doesn't seem to be defined...? Grab it from a valid call to XNextEvent anyway. --GM
+
+static int _shim_XNextEvent(Display *display, XEvent *event_return) {
+  _check_stats_dump();
+
+  if (_merged_event(display, NULL, NULL, event_return, True)) {
+    return last_next_event_result;
+  }
+
+  int result = real.XNextEvent(display, event_return);
+  _saw_real_event(event_return);
+
+  return result;
+}
+
+static int _traced_XNextEvent(Display *display, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  int result = _shim_XNextEvent(display, event_return);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XNextEvent, t0, 0, result, event_return, NULL, 0);
+  return result;
+}
+
+static int _shim_XPeekEvent(Display *display, XEvent *event_return) {
+  if (_merged_event(display, NULL, NULL, event_return, False)) {
+    return last_next_event_result;
+  }
+  return real.XPeekEvent(display, event_return);
+}
+
+//
+// Everything else boils down to a predicate, which we try on our events before handing over to Xlib.
+//
+// The mask ones go by which event mask would have selected an event, the same as Xlib does.
+// (Xlib is a bit pickier with MotionNotify, but we only ever make up KeyPress events.)
+//
+static const long event_type_masks[LASTEvent] = {
+  [KeyPress] = KeyPressMask,
+  [KeyRelease] = KeyReleaseMask,
+  [ButtonPress] = ButtonPressMask,
+  [ButtonRelease] = ButtonReleaseMask,
+  [MotionNotify] = PointerMotionMask | PointerMotionHintMask | ButtonMotionMask
+    | Button1MotionMask | Button2MotionMask | Button3MotionMask | Button4MotionMask | Button5MotionMask,
+  [EnterNotify] = EnterWindowMask,
+  [LeaveNotify] = LeaveWindowMask,
+  [FocusIn] = FocusChangeMask,
+  [FocusOut] = FocusChangeMask,
+  [KeymapNotify] = KeymapStateMask,
+  [Expose] = ExposureMask,
+  [VisibilityNotify] = VisibilityChangeMask,
+  [CreateNotify] = SubstructureNotifyMask,
+  [DestroyNotify] = StructureNotifyMask | SubstructureNotifyMask,
+  [UnmapNotify] = StructureNotifyMask | SubstructureNotifyMask,
+  [MapNotify] = StructureNotifyMask | SubstructureNotifyMask,
+  [MapRequest] = SubstructureRedirectMask,
+  [ReparentNotify] = StructureNotifyMask | SubstructureNotifyMask,
+  [ConfigureNotify] = StructureNotifyMask | SubstructureNotifyMask,
+  [ConfigureRequest] = SubstructureRedirectMask,
+  [GravityNotify] = StructureNotifyMask | SubstructureNotifyMask,
+  [ResizeRequest] = ResizeRedirectMask,
+  [CirculateNotify] = StructureNotifyMask | SubstructureNotifyMask,
+  [CirculateRequest] = SubstructureRedirectMask,
+  [PropertyNotify] = PropertyChangeMask,
+  [ColormapNotify] = ColormapChangeMask,
+};
+
+struct event_match {
+  long mask;
+  int type;
+  Window window;
+};
+
+static Bool _match_mask(Display *display, XEvent *event, XPointer arg) {
+  (void)display;
+  const struct event_match *m = (const struct event_match *)arg;
+  return (event->type >= 0 && event->type < LASTEvent && (event_type_masks[event->type] & m->mask) != 0);
+}
+
+static Bool _match_window_mask(Display *display, XEvent *event, XPointer arg) {
+  const struct event_match *m = (const struct event_match *)arg;
+  return (event->xany.window == m->window && _match_mask(display, event, arg));
+}
+
+static Bool _match_type(Display *display, XEvent *event, XPointer arg) {
+  (void)display;
+  const struct event_match *m = (const struct event_match *)arg;
+  return (event->type == m->type);
+}
+
+static Bool _match_typed_window(Display *display, XEvent *event, XPointer arg) {
+  const struct event_match *m = (const struct event_match *)arg;
+  return (event->xany.window == m->window && _match_type(display, event, arg));
+}
+
+static int _shim_XIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  if (_merged_event(display, predicate, arg, event_return, True)) { return 0; }
+  int result = real.XIfEvent(display, event_return, predicate, arg);
+  _saw_real_event(event_return);
+  return result;
+}
+
+static Bool _shim_XCheckIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  if (_merged_event(display, predicate, arg, event_return, True)) { return True; }
+  Bool result = real.XCheckIfEvent(display, event_return, predicate, arg);
+  if (result) { _saw_real_event(event_return); }
+  return result;
+}
+
+static int _shim_XPeekIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  if (_merged_event(display, predicate, arg, event_return, False)) { return 0; }
+  return real.XPeekIfEvent(display, event_return, predicate, arg);
+}
+
+static int _shim_XMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  struct event_match m = { event_mask, 0, None };
+  if (_merged_event(display, _match_mask, (XPointer)&m, event_return, True)) { return 0; }
+  int result = real.XMaskEvent(display, event_mask, event_return);
+  _saw_real_event(event_return);
+  return result;
+}
+
+static Bool _shim_XCheckMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  struct event_match m = { event_mask, 0, None };
+  if (_merged_event(display, _match_mask, (XPointer)&m, event_return, True)) { return True; }
+  Bool result = real.XCheckMaskEvent(display, event_mask, event_return);
+  if (result) { _saw_real_event(event_return); }
+  return result;
+}
+
+static int _shim_XWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  struct event_match m = { event_mask, 0, w };
+  if (_merged_event(display, _match_window_mask, (XPointer)&m, event_return, True)) { return 0; }
+  int result = real.XWindowEvent(display, w, event_mask, event_return);
+  _saw_real_event(event_return);
+  return result;
+}
+
+static Bool _shim_XCheckWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  struct event_match m = { event_mask, 0, w };
+  if (_merged_event(display, _match_window_mask, (XPointer)&m, event_return, True)) { return True; }
+  Bool result = real.XCheckWindowEvent(display, w, event_mask, event_return);
+  if (result) { _saw_real_event(event_return); }
+  return result;
+}
+
+static Bool _shim_XCheckTypedEvent(Display *display, int event_type, XEvent *event_return) {
+  struct event_match m = { 0, event_type, None };
+  if (_merged_event(display, _match_type, (XPointer)&m, event_return, True)) { return True; }
+  Bool result = real.XCheckTypedEvent(display, event_type, event_return);
+  if (result) { _saw_real_event(event_return); }
+  return result;
+}
+
+static Bool _shim_XCheckTypedWindowEvent(Display *display, Window w, int event_type, XEvent *event_return) {
+  struct event_match m = { 0, event_type, w };
+  if (_merged_event(display, _match_typed_window, (XPointer)&m, event_return, True)) { return True; }
+  Bool result = real.XCheckTypedWindowEvent(display, w, event_type, event_return);
+  if (result) { _saw_real_event(event_return); }
+  return result;
+}
+
+//
+// When an IC or a Display goes away, so does everything we were keeping for it.
+//
+static void _shim_XDestroyIC(XIC ic) {
+  // If it's one of ours, it only gets parked, and only once nobody else is using it. See XCreateIC().
+  Bool parked = False;
+  if (threaded) { pthread_mutex_lock(&ic_cache_lock); }
+  struct ic_cache_entry *e = _ic_cache_find_ic(ic);
+  if (e != NULL && e->refs > 0) {
+    e->refs--;
+    if (e->refs > 0) {
+      if (threaded) { pthread_mutex_unlock(&ic_cache_lock); }
+      return;
+    }
+    _set_ic_focus(ic, False);
+    e->parked_seq = ++ic_cache_seq;
+    parked = True;
+  }
+  if (threaded) { pthread_mutex_unlock(&ic_cache_lock); }
+
+  if (threaded) { pthread_mutex_lock(&ime_states_lock); }
+  for (int i = 0; i < MAX_IME_STATES; i++) {
+    if (ime_states[i].queue != NULL && ime_states[i].ic == ic) {
+      _ime_state_release(&ime_states[i], False);
+    }
+  }
+  if (threaded) { pthread_mutex_unlock(&ime_states_lock); }
+
+  if (!parked) {
+    _destroy_ic(ic);
+  }
+}
+
+static int _shim_XCloseDisplay(Display *display) {
+  if (threaded) { pthread_mutex_lock(&ime_states_lock); }
+  for (int i = 0; i < MAX_IME_STATES; i++) {
+    if (ime_states[i].queue != NULL && ime_states[i].display == display) {
+      _ime_state_release(&ime_states[i], False);
+    }
+  }
+  if (threaded) { pthread_mutex_unlock(&ime_states_lock); }
+
+  _ic_cache_drop(NULL, display);
+  for (int i = 0; i < MAX_ASYNC_IMS; i++) {
+    if (async_ims[i].local_im != NULL && async_ims[i].display == display) {
+      _async_im_release(&async_ims[i], False);
+    }
+  }
+
+  return real.XCloseDisplay(display);
+}
+
+//
+// Recording the rest of the hooks, for when FORCEIME_RECORD is set. See _select_hooks().
+// There's no writing down a predicate, so the ones that take one only get what it picked. See ForceIMETrace.h.
+//
+static int _traced_XPeekEvent(Display *display, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  int result = _shim_XPeekEvent(display, event_return);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XPeekEvent, t0, 0, result, event_return, NULL, 0);
+  return result;
+}
+
+static int _traced_XIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  uint64_t t0 = _now_ns();
+  int result = _shim_XIfEvent(display, event_return, predicate, arg);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XIfEvent, t0, 0, result, event_return, NULL, 0);
+  return result;
+}
+
+static Bool _traced_XCheckIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  uint64_t t0 = _now_ns();
+  Bool result = _shim_XCheckIfEvent(display, event_return, predicate, arg);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XCheckIfEvent, t0, 0, result, (result ? event_return : NULL), NULL, 0);
+  return result;
+}
+
+static int _traced_XPeekIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) {
+  uint64_t t0 = _now_ns();
+  int result = _shim_XPeekIfEvent(display, event_return, predicate, arg);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XPeekIfEvent, t0, 0, result, event_return, NULL, 0);
+  return result;
+}
+
+static int _traced_XMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  int result = _shim_XMaskEvent(display, event_mask, event_return);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XMaskEvent, t0, (int)event_mask, result, event_return, NULL, 0);
+  return result;
+}
+
+static Bool _traced_XCheckMaskEvent(Display *display, long event_mask, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  Bool result = _shim_XCheckMaskEvent(display, event_mask, event_return);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XCheckMaskEvent, t0, (int)event_mask, result, (result ? event_return : NULL), NULL, 0);
+  return result;
+}
+
+static int _traced_XWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  int result = _shim_XWindowEvent(display, w, event_mask, event_return);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XWindowEvent, t0, (int)event_mask, result, event_return, NULL, 0);
+  return result;
+}
+
+static Bool _traced_XCheckWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  Bool result = _shim_XCheckWindowEvent(display, w, event_mask, event_return);
+  _trace_search(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XCheckWindowEvent, t0, (int)event_mask, result, result, event_return, w);
+  return result;
+}
+
+static Bool _traced_XCheckTypedEvent(Display *display, int event_type, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  Bool result = _shim_XCheckTypedEvent(display, event_type, event_return);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XCheckTypedEvent, t0, event_type, result, (result ? event_return : NULL), NULL, 0);
+  return result;
+}
+
+static Bool _traced_XCheckTypedWindowEvent(Display *display, Window w, int event_type, XEvent *event_return) {
+  uint64_t t0 = _now_ns();
+  Bool result = _shim_XCheckTypedWindowEvent(display, w, event_type, event_return);
+  _trace_search(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XCheckTypedWindowEvent, t0, event_type, result, result, event_return, w);
+  return result;
+}
+
+static void _traced_XDestroyIC(XIC ic) {
+  uint64_t t0 = _now_ns();
+  _shim_XDestroyIC(ic);
+  _trace_ic(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XDestroyIC, t0, ic, 0, 0, NULL, NULL, 0);
+}
+
+static void _traced_XSetICFocus(XIC ic) {
+  uint64_t t0 = _now_ns();
+  _shim_XSetICFocus(ic);
+  _trace_ic(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XSetICFocus, t0, ic, 0, 0, NULL, NULL, 0);
+}
+
+static void _traced_XUnsetICFocus(XIC ic) {
+  uint64_t t0 = _now_ns();
+  _shim_XUnsetICFocus(ic);
+  _trace_ic(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XUnsetICFocus, t0, ic, 0, 0, NULL, NULL, 0);
+}
+
+static int _traced_XCloseDisplay(Display *display) {
+  uint64_t t0 = _now_ns();
+  int result = _shim_XCloseDisplay(display);
+  _trace(FORCEIME_TRACE_CALL, FORCEIME_TRACE_XCloseDisplay, t0, 0, result, NULL, NULL, 0);
+  return result;
+}
+
+//
+// A program calling this is telling us it'll use Xlib from more than one thread.
+//
+// libX11 1.8+ calls this from its own constructor, which runs before ours. So the real one might not be looked up yet.
+//
+Status XInitThreads(void) {
+  HOOK_ENTER(XInitThreads);
+  COUNT_CALL(XInitThreads);
+  threaded = 1;
+  if (real.XInitThreads == NULL && !_resolve_real_functions()) { return 0; } // No Xlib, so no threads for it either
+  return real.XInitThreads();
+}
+
+//
+// Picking the hooks.
+//
+// Each exported hook counts the call for the live stats, then jumps through the hooks table.
+// The table gets filled in once, at load, by _select_hooks().
+// So anything that's switched off costs nothing when the program calls in, rather than a check on every call:
+// - A hook in FORCEIME_DISABLE goes straight to the real function. (Dlsym() and ForceIMEAudit.so don't even give out ours.)
+// - XPending() and XEventsQueued() only time frames if DELIVERY_PACED or the stats want them. See _shim_XPending().
+// - Recording wraps the hooks and the real functions it records. When we're not recording, none of that is in the way.
+//
+// Until then, the table points at the usual shims, in case something calls in before our constructor gets to run.
+//
+static struct xlib_functions hooks = {
+#define X(name) .name = _shim_##name,
+  FORCEIME_TABLE_HOOKS(X)
+#undef X
+};
+
+Bool XCheckIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) { HOOK_ENTER(XCheckIfEvent); return hooks.XCheckIfEvent(display, event_return, predicate, arg); }
+Bool XCheckMaskEvent(Display *display, long event_mask, XEvent *event_return) { HOOK_ENTER(XCheckMaskEvent); return hooks.XCheckMaskEvent(display, event_mask, event_return); }
+Bool XCheckTypedEvent(Display *display, int event_type, XEvent *event_return) { HOOK_ENTER(XCheckTypedEvent); return hooks.XCheckTypedEvent(display, event_type, event_return); }
+Bool XCheckTypedWindowEvent(Display *display, Window w, int event_type, XEvent *event_return) { HOOK_ENTER(XCheckTypedWindowEvent); return hooks.XCheckTypedWindowEvent(display, w, event_type, event_return); }
+Bool XCheckWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) { HOOK_ENTER(XCheckWindowEvent); return hooks.XCheckWindowEvent(display, w, event_mask, event_return); }
+int XCloseDisplay(Display *display) { HOOK_ENTER(XCloseDisplay); return hooks.XCloseDisplay(display); }
+Status XCloseIM(XIM im) { HOOK_ENTER(XCloseIM); return hooks.XCloseIM(im); }
+void XDestroyIC(XIC ic) { HOOK_ENTER(XDestroyIC); hooks.XDestroyIC(ic); }
+
+int XEventsQueued(Display *display, int mode) {
+  HOOK_ENTER(XEventsQueued);
+  PROBE(XEventsQueued_entry, 0, mode);
+  int result = hooks.XEventsQueued(display, mode);
+  PROBE(XEventsQueued_return, 0, result);
+  return result;
+}
+
+Bool XFilterEvent(XEvent *event, Window w) {
+  HOOK_ENTER(XFilterEvent);
+  PROBE(XFilterEvent_entry, event->type, 0);
+  Bool result = hooks.XFilterEvent(event, w);
+  PROBE(XFilterEvent_return, event->type, result);
+  return result;
+}
+
+int XIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) { HOOK_ENTER(XIfEvent); return hooks.XIfEvent(display, event_return, predicate, arg); }
+int XMaskEvent(Display *display, long event_mask, XEvent *event_return) { HOOK_ENTER(XMaskEvent); return hooks.XMaskEvent(display, event_mask, event_return); }
+
+int XNextEvent(Display *display, XEvent *event_return) {
+  HOOK_ENTER(XNextEvent);
+  PROBE(XNextEvent_entry, 0, 0);
+  int result = hooks.XNextEvent(display, event_return);
+  PROBE(XNextEvent_return, event_return->type, result);
+  return result;
+}
+
+XIM XOpenIM(Display *display, XrmDatabase db, char *res_name, char *res_class) {
+  HOOK_ENTER(XOpenIM);
+  PROBE(XOpenIM_entry, 0, 0);
+  XIM result = hooks.XOpenIM(display, db, res_name, res_class);
+  PROBE(XOpenIM_return, 0, (uintptr_t)result);
+  return result;
+}
+
+int XPeekEvent(Display *display, XEvent *event_return) { HOOK_ENTER(XPeekEvent); return hooks.XPeekEvent(display, event_return); }
+int XPeekIfEvent(Display *display, XEvent *event_return, Bool (*predicate)(Display *, XEvent *, XPointer), XPointer arg) { HOOK_ENTER(XPeekIfEvent); return hooks.XPeekIfEvent(display, event_return, predicate, arg); }
+
+int XPending(Display *display) {
+  HOOK_ENTER(XPending);
+  PROBE(XPending_entry, 0, 0);
+  int result = hooks.XPending(display);
+  PROBE(XPending_return, 0, result);
+  return result;
+}
+
+void XSetICFocus(XIC ic) { HOOK_ENTER(XSetICFocus); hooks.XSetICFocus(ic); }
+void XUnsetICFocus(XIC ic) { HOOK_ENTER(XUnsetICFocus); hooks.XUnsetICFocus(ic); }
+int XWindowEvent(Display *display, Window w, long event_mask, XEvent *event_return) { HOOK_ENTER(XWindowEvent); return hooks.XWindowEvent(display, w, event_mask, event_return); }
+int XmbLookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) { HOOK_ENTER(XmbLookupString); return hooks.XmbLookupString(ic, event, buffer_return, bytes_buffer, keysym_return, status_return); }
+
+int Xutf8LookupString(XIC ic, XKeyPressedEvent *event, char *buffer_return, int bytes_buffer, KeySym *keysym_return, Status *status_return) {
+  HOOK_ENTER(Xutf8LookupString);
+  PROBE(Xutf8LookupString_entry, event->type, bytes_buffer);
+  int result = hooks.Xutf8LookupString(ic, event, buffer_return, bytes_buffer, keysym_return, status_return);
+  PROBE(Xutf8LookupString_return, event->type, result);
+  return result;
+}
+
+int XwcLookupString(XIC ic, XKeyPressedEvent *event, wchar_t *buffer_return, int wchars_buffer, KeySym *keysym_return, Status *status_return) { HOOK_ENTER(XwcLookupString); return hooks.XwcLookupString(ic, event, buffer_return, wchars_buffer, keysym_return, status_return); }
+
+//
+// With FORCEIME_LIVE_STATS=1, these go in front of the hooks to count the calls. See _select_hooks().
+//
+#define FORCEIME_COUNTED_HOOKS(X) \
+  X(Bool, XCheckIfEvent, (Display *d, XEvent *e, Bool (*pred)(Display *, XEvent *, XPointer), XPointer arg), (d, e, pred, arg)) \
+  X(Bool, XCheckMaskEvent, (Display *d, long mask, XEvent *e), (d, mask, e)) \
+  X(Bool, XCheckTypedEvent, (Display *d, int type, XEvent *e), (d, type, e)) \
+  X(Bool, XCheckTypedWindowEvent, (Display *d, Window w, int type, XEvent *e), (d, w, type, e)) \
+  X(Bool, XCheckWindowEvent, (Display *d, Window w, long mask, XEvent *e), (d, w, mask, e)) \
+  X(int, XCloseDisplay, (Display *d), (d)) \
+  X(Status, XCloseIM, (XIM im), (im)) \
+  X(int, XEventsQueued, (Display *d, int mode), (d, mode)) \
+  X(Bool, XFilterEvent, (XEvent *e, Window w), (e, w)) \
+  X(int, XIfEvent, (Display *d, XEvent *e, Bool (*pred)(Display *, XEvent *, XPointer), XPointer arg), (d, e, pred, arg)) \
+  X(int, XMaskEvent, (Display *d, long mask, XEvent *e), (d, mask, e)) \
+  X(int, XNextEvent, (Display *d, XEvent *e), (d, e)) \
+  X(XIM, XOpenIM, (Display *d, XrmDatabase db, char *res_name, char *res_class), (d, db, res_name, res_class)) \
+  X(int, XPeekEvent, (Display *d, XEvent *e), (d, e)) \
+  X(int, XPeekIfEvent, (Display *d, XEvent *e, Bool (*pred)(Display *, XEvent *, XPointer), XPointer arg), (d, e, pred, arg)) \
+  X(int, XPending, (Display *d), (d)) \
+  X(int, XWindowEvent, (Display *d, Window w, long mask, XEvent *e), (d, w, mask, e)) \
+  X(int, XmbLookupString, (XIC ic, XKeyPressedEvent *e, char *buf, int len, KeySym *keysym, Status *status), (ic, e, buf, len, keysym, status)) \
+  X(int, Xutf8LookupString, (XIC ic, XKeyPressedEvent *e, char *buf, int len, KeySym *keysym, Status *status), (ic, e, buf, len, keysym, status)) \
+  X(int, XwcLookupString, (XIC ic, XKeyPressedEvent *e, wchar_t *buf, int len, KeySym *keysym, Status *status), (ic, e, buf, len, keysym, status))
+
+#define FORCEIME_COUNTED_VOID_HOOKS(X) \
+  X(XDestroyIC, (XIC ic), (ic)) \
+  X(XSetICFocus, (XIC ic), (ic)) \
+  X(XUnsetICFocus, (XIC ic), (ic))
+
+static struct xlib_functions uncounted_hooks;
+
+#define X(type, name, params, args) \
+  static type _counted_##name params { \
+    __atomic_add_fetch(&live_stats->hook_calls[HOOK_##name], 1, __ATOMIC_RELAXED); \
+    return uncounted_hooks.name args; \
+  }
+FORCEIME_COUNTED_HOOKS(X)
+#undef X
+
+#define X(name, params, args) \
+  static void _counted_##name params { \
+    __atomic_add_fetch(&live_stats->hook_calls[HOOK_##name], 1, __ATOMIC_RELAXED); \
+    uncounted_hooks.name args; \
+  }
+FORCEIME_COUNTED_VOID_HOOKS(X)
+#undef X
+
+static void _select_hooks(void) {
+  struct xlib_functions xlib = real;
+
+#ifdef FORCEIME_PROFILE
+  // Profiling goes underneath recording, so what it costs to record counts as ours.
+  _profile_real_functions();
+  const Bool want_frames = True;
+#else
+  const Bool want_frames = False;
+#endif
+  if (delivery_mode != DELIVERY_PACED && stats_file == NULL && !want_frames) {
+    hooks.XPending = _untimed_XPending;
+    hooks.XEventsQueued = _untimed_XEventsQueued;
+  }
+
+  // This goes over profiling and under recording, for the same reason.
+  if (im_timing) {
+    untimed_real = real;
+    real.XFilterEvent = _timed_real_XFilterEvent;
+  }
+
+  if (trace != NULL) {
+    untraced_real = real;
+#define X(name) \
+    hooks.name = _traced_##name; \
+    real.name = _traced_real_##name;
+    X(XNextEvent)
+    X(XPending)
+    X(XEventsQueued)
+    X(XFilterEvent)
+    X(Xutf8LookupString)
+    X(XmbLookupString)
+    X(XwcLookupString)
+    X(XPeekEvent)
+    X(XIfEvent)
+    X(XCheckIfEvent)
+    X(XPeekIfEvent)
+    X(XMaskEvent)
+    X(XCheckMaskEvent)
+    X(XWindowEvent)
+    X(XCheckWindowEvent)
+    X(XCheckTypedEvent)
+    X(XCheckTypedWindowEvent)
+#undef X
+    hooks.XOpenIM = _traced_XOpenIM;
+    hooks.XDestroyIC = _traced_XDestroyIC;
+    hooks.XSetICFocus = _traced_XSetICFocus;
+    hooks.XUnsetICFocus = _traced_XUnsetICFocus;
+    hooks.XCloseDisplay = _traced_XCloseDisplay;
+  }
+
+  // This goes last, so the hook gets the real function rather than a recording of it.
+#define X(name) \
+  if (!HOOK_ENABLED(name)) { \
+    hooks.name = xlib.name; \
+    LOG(LOG_INFO, "ForceIMESupport: not hooking %s\n", #name, 0, 0); \
+  }
+  FORCEIME_TABLE_HOOKS(X)
+#undef X
+
+  // Counting goes in front of all of it, disabled hooks too, since the program did call them.
+  if (live_stats != NULL) {
+    uncounted_hooks = hooks;
+#define X(name) hooks.name = _counted_##name;
+    FORCEIME_TABLE_HOOKS(X)
+#undef X
+  }
+}
+
+//
+// Whether we've found Xlib yet. See _resolve_real_functions().
+//
+enum xlib_state {
+  XLIB_UNKNOWN, // _init() hasn't happened yet
+  XLIB_ABSENT,  // There wasn't one when it did
+  XLIB_READY,
+};
+static int xlib_state = XLIB_UNKNOWN;
+static pthread_mutex_t xlib_state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Finishes what _init() couldn't, if there's an Xlib now. Returns False if there still isn't.
+static Bool _resolve_late(void) {
+  pthread_mutex_lock(&xlib_state_lock);
+  if (xlib_state == XLIB_ABSENT && _resolve_real_functions()) {
+    _select_hooks();
+    ATOMIC_STORE(&xlib_state, XLIB_READY);
+  }
+  Bool ready = (xlib_state == XLIB_READY);
+  pthread_mutex_unlock(&xlib_state_lock);
+  return ready;
+}
+
+//
+// Everything gets set up here, in this order. Settings may well have been read already - see _read_settings().
+//
+__attribute__((constructor))
+static void _init(void) {
+  pthread_once(&settings_once, _read_settings);
+  if (real.XInitThreads == NULL) { _resolve_real_functions(); }
+  _setup_live_stats();
+  _setup_log();
+  _setup_stats();
+  _setup_im_timing();
+  _setup_trace();
+  pthread_mutex_lock(&xlib_state_lock);
+  if (real.XInitThreads != NULL) {
+    _select_hooks();
+    ATOMIC_STORE(&xlib_state, XLIB_READY);
+  } else {
+    ATOMIC_STORE(&xlib_state, XLIB_ABSENT);
+  }
+  pthread_mutex_unlock(&xlib_state_lock);
+#ifdef FORCEIME_PROFILE
+  atexit(_report_profile);
+#endif
+}
+
+//
+// UnityPlayer.so grabs its X11 symbols via dlsym().
+// This causes it to bypass the functions provided in this library.
+//
+// If you do a 1-byte hex edit so that the only instance of "dlsym" in the file becomes "Dlsym",
+// then it will end up using the functions we want it to.
+// (Or, use ForceIMEAudit.so, which does the same thing without patching anything. See that file for details.)
+//
+// UnityPlayer.so resolves hundreds of symbols this way at startup, so we don't want to be slow about it.
+// - The hooked names live in a table which gets sorted once, then binary searched.
+//   To hook something else, add it to FORCEIME_HOOKS and it shows up here too.
+// - Anything we don't hook goes to the real dlsym(), and the result gets cached by (handle, symbol),
+//   as long as neither of those can go away. See _dlsym_cacheable().
+//
+struct hooked_symbol {
+  const char *name;
+  void *func;
+  int id;
+};
+
+static struct hooked_symbol hooked_symbols[] = {
+#define X(name) { #name, (void *)name, HOOK_##name },
+  FORCEIME_HOOKS(X)
+#undef X
+};
+#define HOOKED_SYMBOL_COUNT (sizeof(hooked_symbols) / sizeof(hooked_symbols[0]))
+
+static int _hooked_symbol_cmp(const void *a, const void *b) {
+  return strcmp(((const struct hooked_symbol *)a)->name, ((const struct hooked_symbol *)b)->name);
+}
+
+static pthread_once_t hooked_symbols_sorted = PTHREAD_ONCE_INIT;
+
+static void _sort_hooked_symbols(void) {
+  qsort(hooked_symbols, HOOKED_SYMBOL_COUNT, sizeof(hooked_symbols[0]), _hooked_symbol_cmp);
+}
+
+//
+// Returns our version of a symbol if we hook it, or NULL if we don't (or if it's in FORCEIME_DISABLE).
+// ForceIMEAudit.so calls this too, possibly before our constructors have run - hence the pthread_once()s.
+//
+void *forceime_hook_for(const char *symbol) {
+  pthread_once(&settings_once, _read_settings);
+  if (__builtin_expect(ATOMIC_LOAD(&xlib_state) == XLIB_ABSENT, 0) && !_resolve_late()) { return NULL; }
+  pthread_once(&hooked_symbols_sorted, _sort_hooked_symbols);
+  struct hooked_symbol key = { symbol, NULL, 0 };
+  struct hooked_symbol *hooked = bsearch(&key, hooked_symbols, HOOKED_SYMBOL_COUNT, sizeof(hooked_symbols[0]), _hooked_symbol_cmp);
+  if (hooked == NULL || (disabled_hooks & (1u << hooked->id)) != 0) { return NULL; }
+  return hooked->func;
+}
+
+//
+// The cache is a fixed-size open addressing table. Once it fills up, we just stop caching.
+// Failed lookups aren't cached, so the caller still gets a sensible dlerror().
+//
+// We never see dlclose(), so a handle might get unloaded, and its value handed out again for some other library.
+// So we only cache what comes out of libX11 (which we link against, so it stays loaded as long as we do),
+// looked up through a handle which can't be reused: RTLD_DEFAULT, RTLD_NEXT, or libX11's own. We hold on to a reference to that.
+// That's what UnityPlayer.so looks up all those symbols for, anyway.
+//
+#define DLSYM_CACHE_SIZE 2048 // Must be a power of 2!
+#define DLSYM_CACHE_MASK (DLSYM_CACHE_SIZE - 1)
+struct dlsym_cache_entry {
+  void *handle;
+  char *symbol;
+  unsigned int hash;
+  void *result;
+};
+static struct dlsym_cache_entry dlsym_cache[DLSYM_CACHE_SIZE];
+static int dlsym_cache_used = 0;
+static pthread_mutex_t dlsym_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *xlib_handle = NULL; // Only set once we've found Xlib
+static void *xlib_base = NULL;
+
+// Only call this with dlsym_cache_lock held!
+static Bool _dlsym_cacheable(void *handle, void *result) {
+  if (xlib_base == NULL && ATOMIC_LOAD(&xlib_state) == XLIB_READY) {
+    Dl_info info;
+    if (dladdr((void *)real.XInitThreads, &info) && info.dli_fname != NULL) {
+      xlib_handle = dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+      xlib_base = info.dli_fbase;
+    }
+  }
+  if (xlib_base == NULL) { return False; }
+  if (handle != RTLD_DEFAULT && handle != RTLD_NEXT && handle != xlib_handle) { return False; }
+  Dl_info info;
+  return dladdr(result, &info) && info.dli_fbase == xlib_base;
+}
+
+static unsigned int _dlsym_hash(void *handle, const char *symbol) {
+  // FNV-1a, with the handle mixed in at the start.
+  unsigned int hash = 2166136261u ^ (unsigned int)((uintptr_t)handle >> 4);
+  for (; *symbol != '\0'; symbol++) {
+    hash = (hash ^ (unsigned char)*symbol) * 16777619u;
+  }
+  return hash;
+}
+
+void *Dlsym(void *restrict handle, const char *restrict symbol)
+{
+  //fprintf(stderr, "Dlsym -> dlsym shim: %p \"%s\"\n", handle, symbol); fflush(stderr);
+
+  void *hooked = forceime_hook_for(symbol);
+  if (hooked != NULL) { return hooked; }
+
+  unsigned int hash = _dlsym_hash(handle, symbol);
+  unsigned int slot = hash & DLSYM_CACHE_MASK;
+  void *result = NULL;
+  pthread_mutex_lock(&dlsym_cache_lock);
+  for (; dlsym_cache[slot].symbol != NULL; slot = (slot + 1) & DLSYM_CACHE_MASK) {
+    struct dlsym_cache_entry *e = &dlsym_cache[slot];
+    if (e->hash == hash && e->handle == handle && !strcmp(e->symbol, symbol)) {
+      result = e->result;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&dlsym_cache_lock);
+  if (result != NULL) { return result; }
+
+  result = dlsym(handle, symbol);
+  if (result == NULL) { return NULL; }
+
+  pthread_mutex_lock(&dlsym_cache_lock);
+  // Keep some slack so probing stays short. Someone else may have filled this in meanwhile, but a duplicate is harmless.
+  if (dlsym_cache_used < DLSYM_CACHE_SIZE / 2 && _dlsym_cacheable(handle, result)) {
+    char *copy = strdup(symbol);
+    if (copy != NULL) {
+      for (; dlsym_cache[slot].symbol != NULL; slot = (slot + 1) & DLSYM_CACHE_MASK) {}
+      dlsym_cache[slot] = (struct dlsym_cache_entry){ handle, copy, hash, result };
+      dlsym_cache_used++;
+    }
+  }
+  pthread_mutex_unlock(&dlsym_cache_lock);
+
+  return result;
 }
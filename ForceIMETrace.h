@@ -0,0 +1,108 @@
+// vim: set sts=2 sw=2 et :
+//
+// ForceIMESupport trace format
+// Written by GreaseMonkey, 2022-2023. I release this software into the public domain.
+//
+// With FORCEIME_RECORD set, ForceIMESupport.so writes one of these.
+// ForceIMEReplay reads it back, and ForceIMEChromeTrace turns it into something you can look at in Perfetto.
+//
+// The file is a header, then a run of variable-length records, back to back.
+// Each record is a forceime_trace_record, then payload_len bytes of payload (text from a lookup), padded out to 8 bytes.
+// For XwcLookupString, the payload is the wchar_ts as they were in memory.
+// record_size is the whole thing, padding included, so you can skip records you don't care about.
+//
+// There are two kinds of record:
+// - FORCEIME_TRACE_CALL: the program called one of our hooks, and this is what we gave back.
+// - FORCEIME_TRACE_REAL: we called the real Xlib function, and this is what it gave us.
+// XOpenIM and XCreateIC only get CALL records. They're there to show when input got set up, and replaying skips them.
+// XDestroyIC, XSetICFocus, XUnsetICFocus and XCloseDisplay only get CALL records too, but those do get replayed.
+// Replaying means making the CALLs again, and answering the shim's real calls with the REALs.
+//
+// What doesn't make it in:
+// - The predicate given to XIfEvent, XCheckIfEvent and XPeekIfEvent. It's a function in the program, so there's no writing it down.
+//   All we have is the event it picked (or that it picked nothing), so replaying stands in a predicate which picks that event.
+//   If the shim starts handing over its events in a different order, that can't tell, so it'll match something the program wouldn't have.
+// - ICs and Displays are only pointers, and only good for telling them apart within one recording.
+//   There's one Display as far as replaying is concerned, so a program with more than one gets them all rolled together.
+// - Any other Xlib call. The shim doesn't hook them, so it never sees them.
+//
+// Everything is in native byte order. This is for replaying on the same sort of machine, not for archiving.
+//
+
+#ifndef FORCEIME_TRACE_H
+#define FORCEIME_TRACE_H
+
+#include <stdint.h>
+
+#define FORCEIME_TRACE_MAGIC "FIMETRC\0"
+#define FORCEIME_TRACE_VERSION 2
+
+struct forceime_trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t start_ns;  // CLOCK_MONOTONIC when recording started. Record timestamps are relative to this.
+  uint64_t used;      // Bytes of records after the header
+  uint64_t capacity;  // Bytes of room for records after the header
+  uint64_t dropped;   // Records which didn't fit
+};
+
+enum forceime_trace_kind {
+  FORCEIME_TRACE_CALL = 1,
+  FORCEIME_TRACE_REAL = 2,
+};
+
+enum forceime_trace_func {
+  FORCEIME_TRACE_XNextEvent = 1,
+  FORCEIME_TRACE_XPending,
+  FORCEIME_TRACE_XEventsQueued,
+  FORCEIME_TRACE_Xutf8LookupString,
+  FORCEIME_TRACE_XFilterEvent,
+  FORCEIME_TRACE_XCheckTypedEvent,
+  FORCEIME_TRACE_XmbLookupString,
+  FORCEIME_TRACE_XwcLookupString,
+  FORCEIME_TRACE_XOpenIM,
+  FORCEIME_TRACE_XCreateIC,
+  FORCEIME_TRACE_XPeekEvent,
+  FORCEIME_TRACE_XIfEvent,
+  FORCEIME_TRACE_XCheckIfEvent,
+  FORCEIME_TRACE_XPeekIfEvent,
+  FORCEIME_TRACE_XMaskEvent,
+  FORCEIME_TRACE_XCheckMaskEvent,
+  FORCEIME_TRACE_XWindowEvent,
+  FORCEIME_TRACE_XCheckWindowEvent,
+  FORCEIME_TRACE_XCheckTypedWindowEvent,
+  FORCEIME_TRACE_XDestroyIC,
+  FORCEIME_TRACE_XSetICFocus,
+  FORCEIME_TRACE_XUnsetICFocus,
+  FORCEIME_TRACE_XCloseDisplay,
+};
+
+//
+// Just the bits of an XEvent we care about.
+// keycode, state and time are only filled in for KeyPress and KeyRelease.
+//
+struct forceime_trace_event {
+  int32_t type;
+  uint32_t keycode;
+  uint32_t state;
+  uint32_t time;
+  uint64_t window;
+};
+
+struct forceime_trace_record {
+  uint64_t ns;           // When the call started, relative to start_ns
+  uint64_t dur_ns;       // How long the call took
+  uint16_t kind;         // enum forceime_trace_kind
+  uint16_t func;         // enum forceime_trace_func
+  uint32_t record_size;  // Including payload and padding
+  int32_t arg;           // XEventsQueued: mode. XCheckTyped*Event: event type. X*MaskEvent, X*WindowEvent: event mask. *LookupString: the Status we returned. XCreateIC: the input style asked for.
+  int32_t result;        // XOpenIM, XCreateIC: 1 if we handed one back, 0 if not. XDestroyIC, X*ICFocus: nothing.
+  uint32_t payload_len;
+  uint32_t reserved;
+  struct forceime_trace_event event;  // Calls that look for an event: what we got. *LookupString, XFilterEvent: what we were given. XCreateIC: just the client window.
+                                      // X*WindowEvent, XCheckTypedWindowEvent: if nothing turned up, just the window asked about.
+  uint64_t ic;           // *LookupString, XCreateIC (the one we handed back), XDestroyIC, X*ICFocus: which IC. 0 for everything else.
+};
+
+#endif
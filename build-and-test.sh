@@ -1,2 +1,26 @@
 #!/bin/sh
-gcc -fPIC -shared -O1 -g -o ForceIMESupport.so ForceIMESupport.c -ldl -lX11 -Wall -Wextra -Werror && LD_PRELOAD=./ForceIMESupport.so $@
+# USDT probes need <sys/sdt.h>. Without it, the shim won't build with -Werror unless we say we know.
+PROBES=
+echo '#include <sys/sdt.h>' | gcc -E - >/dev/null 2>&1 || PROBES=-DFORCEIME_NO_PROBES
+# If they're meant to be there, every one of them has to be, with all three arguments. arg0 (the queue depth) can't be a constant.
+check_probes() {
+  if [ -n "$PROBES" ]; then echo "USDT probes: NOT compiled in (no <sys/sdt.h>)"; return 0; fi
+  readelf -n "$1" | awk '/Provider: forceime/ { p = 1; next }
+    p && /Arguments:/ { n++; if (NF != 4 || $2 ~ /@\$/) { print "USDT probe with bad arguments: " $0; bad++ } p = 0 }
+    END { if (n == 0 || bad > 0) { print "USDT probes: missing or broken in '"$1"'"; exit 1 } print "USDT probes: " n " compiled in" }'
+}
+gcc $PROBES -fPIC -shared -O1 -g -o ForceIMESupport.so ForceIMESupport.c -ldl -lrt -Wl,--no-as-needed -lX11 -Wall -Wextra -Werror && \
+check_probes ForceIMESupport.so && \
+mkdir -p profile && \
+gcc $PROBES -DFORCEIME_PROFILE -fPIC -shared -O1 -g -o profile/ForceIMESupport.so ForceIMESupport.c -ldl -lrt -Wl,--no-as-needed -lX11 -Wall -Wextra -Werror && \
+gcc -fPIC -shared -O1 -g -o ForceIMEAudit.so ForceIMEAudit.c -Wall -Wextra -Werror && \
+gcc -O1 -g -rdynamic -o ForceIMEReplay ForceIMEReplay.c -ldl -Wall -Wextra -Werror && \
+gcc -O1 -g -o ForceIMEStat ForceIMEStat.c -lrt -Wall -Wextra -Werror && \
+gcc -O1 -g -o ForceIMEChromeTrace ForceIMEChromeTrace.c -Wall -Wextra -Werror && \
+gcc -fPIC -shared -O1 -g -o ForceIMEStubXlib.so ForceIMEStubXlib.c -lpthread -Wall -Wextra -Werror && \
+gcc -O1 -g -o ForceIMEBench ForceIMEBench.c -ldl -L. -l:ForceIMEStubXlib.so -Wl,-rpath,'$ORIGIN' -Wall -Wextra -Werror && \
+./ForceIMEBench -n 100000 && \
+gcc -O1 -g -o ForceIMEStress ForceIMEStress.c -ldl -lpthread -L. -l:ForceIMEStubXlib.so -Wl,-rpath,'$ORIGIN' -Wall -Wextra -Werror && \
+./ForceIMEStress && \
+FORCEIME_DELIVERY=paced ./ForceIMEStress && \
+LD_AUDIT=./ForceIMEAudit.so LD_PRELOAD=./ForceIMESupport.so $@